@@ -6,31 +6,161 @@
 #include "utils.h"
 #include "author.h"
 #include "topic.h"
+#include "tree.h"
+
+#define MIN_AUTHOR_CAPACITY 8
+
+// compact() leaves room for 1 / AUTHOR_SLACK_RATIO more words after the
+// list of each author.
+#define AUTHOR_SLACK_RATIO 8
 
 namespace hatm {
 
+// =======================================================================
+// AuthorWords
+// =======================================================================
+
+void AuthorWords::addAuthor() {
+	begins_.push_back(words_.size());
+	sizes_.push_back(0);
+	capacities_.push_back(0);
+}
+
+void AuthorWords::resizeWords(int word_no) {
+	positions_.resize(word_no, -1);
+}
+
+void AuthorWords::setWords(int author, const vector<int>& words) {
+	int size = words.size();
+	if (size > capacities_[author]) {
+		relocate(author, size + size / AUTHOR_SLACK_RATIO);
+	}
+	int begin = begins_[author];
+	for (int i = 0; i < size; i++) {
+		words_[begin + i] = words[i];
+		positions_[words[i]] = i;
+	}
+	sizes_[author] = size;
+}
+
+void AuthorWords::addWord(int author, int word) {
+	if (sizes_[author] == capacities_[author]) {
+		relocate(author, max(2 * capacities_[author], MIN_AUTHOR_CAPACITY));
+	}
+	int position = sizes_[author]++;
+	words_[begins_[author] + position] = word;
+	positions_[word] = position;
+}
+
+void AuthorWords::removeWord(int author, int word) {
+	int position = positions_[word];
+	int begin = begins_[author];
+	if (position < 0 || position >= sizes_[author] ||
+			words_[begin + position] != word) {
+		return;
+	}
+	int last = words_[begin + sizes_[author] - 1];
+	words_[begin + position] = last;
+	positions_[last] = position;
+	positions_[word] = -1;
+	sizes_[author]--;
+}
+
+void AuthorWords::reserve(int author, int words) {
+	int size = sizes_[author] + words;
+	if (size > capacities_[author]) {
+		relocate(author, max(size, 2 * capacities_[author]));
+	}
+}
+
+void AuthorWords::relocate(int author, int capacity) {
+	int begin = words_.size();
+	words_.resize(begin + capacity);
+	copy(words_.begin() + begins_[author],
+			 words_.begin() + begins_[author] + sizes_[author],
+			 words_.begin() + begin);
+	begins_[author] = begin;
+	capacities_[author] = capacity;
+}
+
+void AuthorWords::compact() {
+	int authors = begins_.size();
+	int total = 0;
+	for (int i = 0; i < authors; i++) {
+		total += sizes_[i] + sizes_[i] / AUTHOR_SLACK_RATIO;
+	}
+	vector<int> words(total);
+	int begin = 0;
+	for (int i = 0; i < authors; i++) {
+		copy(words_.begin() + begins_[i],
+				 words_.begin() + begins_[i] + sizes_[i],
+				 words.begin() + begin);
+		begins_[i] = begin;
+		capacities_[i] = sizes_[i] + sizes_[i] / AUTHOR_SLACK_RATIO;
+		begin += capacities_[i];
+	}
+	words_.swap(words);
+}
+
+void AuthorWords::renumber(const vector<int>& new_index) {
+	vector<int> positions(positions_.size(), -1);
+	int authors = begins_.size();
+	for (int i = 0; i < authors; i++) {
+		for (int j = begins_[i]; j < begins_[i] + sizes_[i]; j++) {
+			words_[j] = new_index[words_[j]];
+			positions[words_[j]] = j - begins_[i];
+		}
+	}
+	positions_.swap(positions);
+	compact();
+}
+
 // =======================================================================
 // Author
 // =======================================================================
 
-Author::Author() {	
+Author::Author()
+		: words_(nullptr) {
 }
 
 Author::Author(int id, int depth) 
 		: id_(id),
 		  path_(depth, nullptr),
 		  depth_(depth),
+		  words_(nullptr),
 		  level_counts_(depth, 0),
 		  log_pr_level_(depth, 0.0) {
 
 }
 
-void Author::removeWord(int word) {
-	auto found = find(begin(words_), end(words_), word);
-	if (found == end(words_)) {
+void Author::computeLevelWordCounts(AllWords* all_words, int depth) {
+	level_word_ids_.resize(depth);
+	level_word_counts_.resize(depth);
+	for (int i = 0; i < depth; i++) {
+		level_word_ids_[i].clear();
+		level_word_counts_[i].clear();
+	}
+
+	for (int i = 0; i < getWords(); i++) {
+		int word = getWord(i);
+		int level = all_words->getLevel(word);
+		if (level >= 0 && level < depth) {
+			level_word_ids_[level].push_back(all_words->getId(word));
+		}
+	}
 
-	} else {
-		words_.erase(found);
+	// Sort the word ids and collapse runs into (word id, count) pairs.
+	for (int i = 0; i < depth; i++) {
+		vector<int>& ids = level_word_ids_[i];
+		sort(ids.begin(), ids.end());
+		int size = ids.size();
+		for (int j = 0; j < size; j++) {
+			if (j > 0 && ids[j] == ids[j - 1]) {
+				level_word_counts_[i].back().second++;
+			} else {
+				level_word_counts_[i].push_back(make_pair(ids[j], 1));
+			}
+		}
 	}
 }
 
@@ -77,17 +207,6 @@ void Author::computeLogPrLevel(double gem_mean,
 
 
 
-// =======================================================================
-// AllAuthors
-// =======================================================================
-
-AllAuthors& AllAuthors::GetInstance() {
-	static AllAuthors instance;
-	return instance;
-}
-
-
-
 // =======================================================================
 // AuthorUtils
 // =======================================================================
@@ -117,6 +236,7 @@ void AuthorUtils::PermuteWords(Author* author) {
 
 
 void AuthorUtils::SampleLevels(
+			AllWords* all_words,
 			Author* author,
       int permute_words,
       bool remove,
@@ -130,46 +250,74 @@ void AuthorUtils::SampleLevels(
 		PermuteWords(author);
 	}
 
-	AllWords& all_words = AllWords::GetInstance();
-
 	for (int i = 0; i < author->getWords(); i++) {
-		int word_idx = author->getWord(i);
-		Word* word = all_words.getMutableWord(word_idx);
-
-		if (remove) {
-			int level = word->getLevel();
-			if (level != -1) {
-				// Update the word level.
-				author->updateLevelCounts(level, -1);
-			
-				// Decrease the word count.
-				author->getMutablePathTopic(level)->updateWordCount(word->getId(), -1);
-			}
-		}
+		SampleWordLevel(all_words, author->getWord(i), author, remove,
+				gem_mean, gem_scale, &log_pr);
+	}
+}
 
-		// Compute probabilities.
-		// Compute log prbabilities for all levels.
-		// Use the corpus GEM mean and scale.
-		author->computeLogPrLevel(gem_mean, gem_scale, depth);
-
-		for (int j = 0; j < depth; j++) {
-			double log_pr_level = author->getLogPrLevel(j);
-			double log_pr_word = 
-					author->getMutablePathTopic(j)->getLogPrWord(word->getId());
-
-			double log_value = log_pr_level + log_pr_word;
-			// Keep for each level the log probability of the word +
-      // log probability of the level.
-      // Use these values to sample the new level.
-      log_pr.at(j) = log_value;
+void AuthorUtils::SampleLevelsOfWords(
+			AllWords* all_words,
+			Author* author,
+			bool remove,
+			double gem_mean,
+			double gem_scale,
+			const vector<int>& words,
+			int begin,
+			int end) {
+	int depth = author->getMutablePathTopic(0)->getMutableTree()->getDepth();
+	vector<double> log_pr(depth);
+
+	for (int i = begin; i < end; i++) {
+		SampleWordLevel(all_words, words[i], author, remove, gem_mean, gem_scale,
+				&log_pr);
+	}
+}
+
+void AuthorUtils::SampleWordLevel(
+			AllWords* all_words,
+			int word,
+			Author* author,
+			bool remove,
+			double gem_mean,
+			double gem_scale,
+			vector<double>* log_pr) {
+	int depth = log_pr->size();
+	int word_id = all_words->getId(word);
+
+	if (remove) {
+		int level = all_words->getLevel(word);
+		if (level != -1) {
+			// Update the word level.
+			author->updateLevelCounts(level, -1);
+
+			// Decrease the word count.
+			author->getMutablePathTopic(level)->updateWordCount(word_id, -1);
 		}
+	}
+
+	// Compute probabilities.
+	// Compute log prbabilities for all levels.
+	// Use the corpus GEM mean and scale.
+	author->computeLogPrLevel(gem_mean, gem_scale, depth);
+
+	for (int j = 0; j < depth; j++) {
+		double log_pr_level = author->getLogPrLevel(j);
+		double log_pr_word =
+				author->getMutablePathTopic(j)->getLogPrWord(word_id);
+
+		double log_value = log_pr_level + log_pr_word;
+		// Keep for each level the log probability of the word +
+		// log probability of the level.
+		// Use these values to sample the new level.
+		log_pr->at(j) = log_value;
+	}
 
-		// Sample the new level and update.
-    int new_level = Utils::SampleFromLogPr(log_pr);
-    author->getMutablePathTopic(new_level)->updateWordCount(word->getId(), 1);
-    word->setLevel(new_level);
-    author->updateLevelCounts(new_level, 1);
- 	}
+	// Sample the new level and update.
+	int new_level = Utils::SampleFromLogPr(*log_pr);
+	author->getMutablePathTopic(new_level)->updateWordCount(word_id, 1);
+	all_words->setLevel(word, new_level);
+	author->updateLevelCounts(new_level, 1);
 }
 
 // =======================================================================
@@ -178,30 +326,29 @@ void AuthorUtils::SampleLevels(
 
 void AuthorTreeUtils::RemoveAuthorFromPath(
       Tree* tree,
+      AllWords* all_words,
       Author* author,
       int start_level) {
-	UpdateTreeFromAuthor(author, -1, start_level);
+	UpdateTreeFromAuthor(all_words, author, -1, start_level);
 	Topic* topic = author->getMutablePathTopic(tree->getDepth() - 1);
 	TopicUtils::Prune(topic);
 }
 
 void AuthorTreeUtils::UpdateTreeFromAuthor(
+      AllWords* all_words,
       Author* author,
       int update,
       int start_level) {
 	// The depth of the tree.
 	int depth = author->getMutablePathTopic(0)->getMutableTree()->getDepth();
 
-	AllWords& all_words = AllWords::GetInstance();
-
 	// Update the word count of the topic for all the words in the author.
 	for (int i = 0; i < author->getWords(); i++) {
 		int word_idx = author->getWord(i);
-		Word* word = all_words.getMutableWord(word_idx);
-		int level = word->getLevel();
+		int level = all_words->getLevel(word_idx);
 		if (level > start_level) {
 			Topic* topic = author->getMutablePathTopic(level);
-			topic->updateWordCount(word->getId(), update);
+			topic->updateWordCount(all_words->getId(word_idx), update);
 		}
 	}
 
@@ -214,34 +361,42 @@ void AuthorTreeUtils::UpdateTreeFromAuthor(
 }
 
 void AuthorTreeUtils::SampleAuthorPath(Tree* tree,
+																       AllWords* all_words,
 																       Author* author,
 																       bool remove,
 																       int start_level) {
 
  // Remove the author from the path at the specified level (start_level).
   if (remove) {
-    RemoveAuthorFromPath(tree, author, start_level);
+    RemoveAuthorFromPath(tree, all_words, author, start_level);
   }
 
-  double log_sum = 0.0;
+  // The word levels do not change while sampling the path, so the
+  // level histograms are built once and shared by the whole traversal.
+  author->computeLevelWordCounts(all_words, tree->getDepth());
 
   // Path probabilities.
   vector<double> path_pr(tree->getDepth(), 0.0);
   Topic* start_topic = author->getMutablePathTopic(start_level);
 
+  // Probabilities of the levels for new topics.
+  vector<double> new_topic_pr(tree->getDepth(), 0.0);
+  AuthorTopicUtils::NewTopicProbabilities(tree, author, &new_topic_pr);
+
   // Compute path probabilities starting at the topic and
   // visiting all its children depth-first.
+  vector<int> slots;
+  vector<double> topic_pr;
   AuthorTopicUtils::ProbabilitiesDfs(
-      start_topic, author, &log_sum,
-      &path_pr, start_level);
+      tree, start_topic->getSlot(), author, &path_pr, new_topic_pr,
+      start_level, &slots, &topic_pr);
 
   // Sample node and fill tree.
-  Topic* topic = TopicUtils::SampleTopic(
-      author->getMutablePathTopic(start_level), log_sum);
+  Topic* topic = TopicUtils::SampleTopic(tree, slots, topic_pr);
   topic = TopicUtils::AddTopic(topic);
 
   // Add path to the author, start at the specified start level.
-  AuthorTopicUtils::AddPathToAuthor(topic, author, start_level);
+  AuthorTopicUtils::AddPathToAuthor(topic, all_words, author, start_level);
 }
 
 
@@ -252,6 +407,7 @@ void AuthorTreeUtils::SampleAuthorPath(Tree* tree,
 
 void AuthorTopicUtils::AddPathToAuthor(
       Topic* topic,
+      AllWords* all_words,
       Author* author,
       int start_level) {
 	int depth = topic->getMutableTree()->getDepth();
@@ -265,42 +421,55 @@ void AuthorTopicUtils::AddPathToAuthor(
   } while (level >= start_level);
 
   // Update the topics from the author.
-  AuthorTreeUtils::UpdateTreeFromAuthor(author, 1, start_level);
+  AuthorTreeUtils::UpdateTreeFromAuthor(all_words, author, 1, start_level);
 
 }
 
+void AuthorTopicUtils::NewTopicProbabilities(
+      Tree* tree,
+      Author* author,
+      vector<double>* new_topic_pr) {
+	int depth = tree->getDepth();
+
+	for (int i = 0; i < depth; i++) {
+		new_topic_pr->at(i) = LogGammaRatio(tree, author, -1, i);
+	}
+}
+
 void AuthorTopicUtils::ProbabilitiesDfs(
-      Topic* topic,
+      Tree* tree,
+      int slot,
       Author* author,	
-      double* log_sum,
       vector<double>* path_pr,
-      int start_level) {
-	int level = topic->getLevel();
-	int depth = topic->getMutableTree()->getDepth();
-
-	double eta = topic->getMutableTree()->getEta(level);
-	int term_no = topic->getCorpusWordNo();
+      const vector<double>& new_topic_pr,
+      int start_level,
+      vector<int>* slots,
+      vector<double>* topic_pr) {
+	int level = tree->getLevel(slot);
+	int depth = tree->getDepth();
+	double scaling = tree->getScaling(slot);
+	int author_no = tree->getAuthorNo(slot);
 
 	// Set path probability for current toipic node in the tree.
-	path_pr->at(level) = LogGammaRatio(author, topic, level, eta, term_no);
+	path_pr->at(level) = LogGammaRatio(tree, author, slot, level);
 
 	double parent_log_val = 0.0;
 
 	if (level > start_level) {
-		parent_log_val = log(topic->getMutableParent()->getAuthorNo() + 
-			topic->getMutableParent()->getScaling());
-		path_pr->at(level) += log(topic->getAuthorNo() - parent_log_val);
+		int parent = tree->getParent(slot);
+		parent_log_val = log(tree->getAuthorNo(parent) +
+			tree->getScaling(parent));
+		path_pr->at(level) += log(author_no) - parent_log_val;
 	}
 
 	// Set path probabilities for level below this topic.
 	if (level < depth - 1) {
     for (int i = level + 1; i < depth; i++) {
-      eta = topic->getMutableTree()->getEta(i);
-      path_pr->at(i) = LogGammaRatio(author, NULL, i, eta, term_no);
+      path_pr->at(i) = new_topic_pr[i];
     }
 
-    path_pr->at(level+1) += log(topic->getScaling());
-    path_pr->at(level+1) -= log(topic->getAuthorNo() + topic->getScaling());
+    path_pr->at(level+1) += log(scaling);
+    path_pr->at(level+1) -= log(author_no + scaling);
   }
 
   // Set probability for the topic.
@@ -308,67 +477,80 @@ void AuthorTopicUtils::ProbabilitiesDfs(
   for (int i = start_level; i < depth; i++) {
     probability += path_pr->at(i);
   }
-  topic->setProbability(probability);
-
-  // Update the normalizing constant.
-  if (level == start_level) {
-    *log_sum = probability;
-  } else {
-    *log_sum = Utils::LogSum(*log_sum, probability);
-  }
+  slots->push_back(slot);
+  topic_pr->push_back(probability);
 
   // Recursive call for the children.
-  for (int i = 0; i < topic->getChildren(); i++) {
+  for (int child = tree->getFirstChild(slot); child != -1;
+       child = tree->getNextSibling(child)) {
     ProbabilitiesDfs(
-        topic->getMutableChild(i), author, log_sum, path_pr, start_level);
+        tree, child, author, path_pr,
+        new_topic_pr, start_level, slots, topic_pr);
   }
 }
 
 double AuthorTopicUtils::LogGammaRatio(
+      Tree* tree,
       Author* author,
-      Topic* topic,
-      int level,
-      double eta,
-      int term_no) {
-	std::vector<int> count(term_no, 0);
-	AllWords& all_words = AllWords::GetInstance();
-
-	for (int i = 0; i < author->getWords(); i++) {
-		int word_idx = author->getWord(i);
-		Word* word = all_words.getMutableWord(word_idx);
-		if (word->getLevel() == level) {
-			count[word->getId()]++;
-		}
-	}
+      int slot,
+      int level) {
+	const vector<pair<int, int> >& counts = author->getLevelWordCounts(level);
+	LogGammaTable* lgam_eta = tree->getMutableLogGammaEta(level);
+	LogGammaTable* lgam_term_eta = tree->getMutableLogGammaTermEta(level);
 
 	int word_no = 0;
 
-	// Topic can be NULL, in which case the result doesn't include the
-  // Word count for the topic.
-  if (topic != NULL) {
-    word_no = topic->getTopicWordNo();
+	// Slot can be -1 for a new topic, in which case the result doesn't
+  // include the word count for the topic.
+  if (slot != -1) {
+    word_no = tree->getTopicWordNo(slot);
   }
 
-
-  double result = gsl_sf_lngamma(word_no + term_no * eta); 
-  double value = word_no + author->getLevelCounts(level) + term_no * eta; 
-  result -= gsl_sf_lngamma(value);
-
-  for (int i = 0; i < author->getWords(); i++) {
-  	int word_idx = author->getWord(i);
-  	int word_id = all_words.getMutableWord(word_idx)->getId();
-    if (count[word_id] > 0) {
-      int word_count = 0;
-      if (topic != NULL) {
-        word_count = topic->getWordCount(word_id);
-      }
-      result -= gsl_sf_lngamma(word_count + eta);
-      result += gsl_sf_lngamma(word_count + count[word_id] + eta);
-      count[word_id] = 0;
-    } 
+  // lngamma(word_no + term_no * eta) -
+  // lngamma(word_no + level_counts + term_no * eta).
+  double result = -lgam_term_eta->LogRising(
+      word_no, author->getLevelCounts(level));
+
+  // Only the distinct words of the author at this level contribute.
+  int size = counts.size();
+  for (int i = 0; i < size; i++) {
+    int word_count = 0;
+    if (slot != -1) {
+      word_count = tree->getTopicWords(slot).getWordCount(counts[i].first);
+    }
+    result += lgam_eta->LogRising(word_count, counts[i].second);
   }
 
   return result;
 }
 
-}  // namespace hatm
\ No newline at end of file
+// =======================================================================
+// AllAuthors
+// =======================================================================
+
+AllAuthors::AllAuthors(const AllAuthors& from)
+		: authors_(from.authors_),
+		  words_(from.words_) {
+	bindAuthorWords();
+}
+
+AllAuthors& AllAuthors::operator=(const AllAuthors& from) {
+	authors_ = from.authors_;
+	words_ = from.words_;
+	bindAuthorWords();
+	return *this;
+}
+
+void AllAuthors::addAuthor(int id, int depth) {
+	authors_.emplace_back(Author(id, depth));
+	authors_.back().setAuthorWords(&words_);
+	words_.addAuthor();
+}
+
+void AllAuthors::bindAuthorWords() {
+	for (size_t i = 0; i < authors_.size(); i++) {
+		authors_[i].setAuthorWords(&words_);
+	}
+}
+
+}  // namespace hatm
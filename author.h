@@ -4,6 +4,7 @@
 #include <vector>
 #include <string>
 #include <unordered_map>
+#include <utility>
 
 
 #include "document.h"
@@ -16,6 +17,64 @@ namespace hatm {
 class Topic;
 class Tree;
 
+// The word lists of all authors in one array, in a compressed sparse
+// row layout: the words of an author are in a contiguous range of the
+// array, followed by free room for more words. The position of every
+// word in the list of its author is kept, so a word is removed in
+// constant time by moving the last word of the author into its place.
+// An author whose room runs out is moved to the end of the array;
+// compact() lays the lists out again without the ranges left behind.
+// Lists of different authors can be changed from different threads as
+// long as no list is moved, see reserve().
+class AuthorWords {
+public:
+	AuthorWords() {}
+
+	// Add an author with no words.
+	void addAuthor();
+
+	// Make room for the positions of word_no words.
+	void resizeWords(int word_no);
+
+	int getWords(int author) const { return sizes_[author]; }
+	int getWord(int author, int i) const { return words_[begins_[author] + i]; }
+
+	void setWords(int author, const vector<int>& words);
+	void addWord(int author, int word);
+
+	// Remove the word from the list of the author, if it is there, by
+	// moving the last word of the author into its place.
+	void removeWord(int author, int word);
+
+	// Make room for words more words in the list of the author, so that
+	// adding them does not move the list.
+	void reserve(int author, int words);
+
+	// Lay the lists out again in the order of the authors, each followed
+	// by some free room.
+	void compact();
+
+	// Replace every word by new_index[word], keeping the lists in order,
+	// and compact the lists.
+	void renumber(const vector<int>& new_index);
+
+private:
+	// Move the list of the author to the end of the array, with room for
+	// capacity words.
+	void relocate(int author, int capacity);
+
+	// The word lists.
+	vector<int> words_;
+
+	// The start, the length and the room of the list of each author.
+	vector<int> begins_;
+	vector<int> sizes_;
+	vector<int> capacities_;
+
+	// The position of each word in the list of its author.
+	vector<int> positions_;
+};
+
 // An author has an id, a author score, a topic path
 // from the root of the tree to the leaf and
 // statistics for words assigned to different levels in
@@ -51,13 +110,25 @@ public:
 	double getLogPrLevel(int depth) const { return log_pr_level_[depth]; }
 	void computeLogPrLevel(double gem_mean, double gem_scale, int depth);
 
-	int getWords() const { return words_.size(); }
-	void setWords(vector<int>&& words) { words_ = move(words); }
+	// The words of the author are kept in the AuthorWords of the authors,
+	// see AllAuthors.
+	void setAuthorWords(AuthorWords* words) { words_ = words; }
 
-	int getWord(int i) { return words_.at(i); }
-	void setWord(int i, const int& word) { words_.at(i) = word; }
-	void addWord(int word) { words_.push_back(word); }
-	void removeWord(int word);
+	int getWords() const { return words_->getWords(id_); }
+	void setWords(const vector<int>& words) { words_->setWords(id_, words); }
+
+	int getWord(int i) const { return words_->getWord(id_, i); }
+	void addWord(int word) { words_->addWord(id_, word); }
+	void removeWord(int word) { words_->removeWord(id_, word); }
+
+	// Build, for every level, a sparse histogram of the words assigned
+	// to that level as (word id, count) pairs sorted by word id.
+	// The buffers are kept between calls, so after warm-up no memory
+	// is allocated.
+	void computeLevelWordCounts(AllWords* all_words, int depth);
+	const vector<pair<int, int> >& getLevelWordCounts(int level) const {
+		return level_word_counts_[level];
+	}
 
 private:
 	// Author id;
@@ -69,7 +140,8 @@ private:
 	// Depth of the tree.
 	int depth_;
 
-	vector<int> words_;
+	// The word lists of the authors.
+	AuthorWords* words_;
 	// Word counts.
 	// std::vector<int> word_counts_;
 
@@ -79,6 +151,12 @@ private:
 	// Log p(level) which is unnormalized.
 	vector<double> log_pr_level_;
 
+	// Sparse word histograms per level, see computeLevelWordCounts.
+	vector<vector<pair<int, int> > > level_word_counts_;
+
+	// Word ids per level, scratch space for computeLevelWordCounts.
+	vector<vector<int> > level_word_ids_;
+
 	// Author score.
 	double score_;
 
@@ -98,13 +176,38 @@ public:
   // The GEM distribution mean and scale parameters determined at corpus
   // level are provided as input.
 	static void SampleLevels(
+			AllWords* all_words,
 			Author* author,
       int permute_words,
       bool remove,
       double gem_mean,
       double gem_scale);
 
+	// Sample the levels of the words words[begin .. end) of the author,
+	// like SampleLevels without permuting.
+	static void SampleLevelsOfWords(
+			AllWords* all_words,
+			Author* author,
+			bool remove,
+			double gem_mean,
+			double gem_scale,
+			const vector<int>& words,
+			int begin,
+			int end);
+
 	static void PermuteWords(Author* author);
+
+private:
+	// Sample the level of word of the author. log_pr has an element
+	// for each level.
+	static void SampleWordLevel(
+			AllWords* all_words,
+			int word,
+			Author* author,
+			bool remove,
+			double gem_mean,
+			double gem_scale,
+			vector<double>* log_pr);
 };
 
 // This class provides functionality for sampling the
@@ -118,6 +221,7 @@ public:
 	// with each author conditioned on all other paths and the oberserved words.
 	static void SampleAuthorPath(
       Tree* tree,
+      AllWords* all_words,
       Author* author,
       bool remove,
       int start_level);
@@ -126,12 +230,14 @@ public:
   // given a particular start level.
   static void RemoveAuthorFromPath(
       Tree* tree,
+      AllWords* all_words,
       Author* author,
       int start_level);
 
   // Update the topics from a author beginning at a specified level,
   // by updating the word and author counts.
   static void UpdateTreeFromAuthor(
+      AllWords* all_words,
       Author* author,
       int update,
       int start_level);
@@ -145,50 +251,70 @@ class AuthorTopicUtils {
   // Fill in the topic path for this document.
   static void AddPathToAuthor(
       Topic* topic,
+      AllWords* all_words,
       Author* Author,
       int start_level);
 
+  // Compute the log gamma ratio of the author's words at each level
+  // for a new (empty) topic. The values only depend on the author and
+  // the level, so they are computed once per path sampling.
+  static void NewTopicProbabilities(
+      Tree* tree,
+      Author* author,
+      vector<double>* new_topic_pr);
+
   // Compute path probabilities by traversing the tree depth-first.
+  // new_topic_pr holds the values computed by NewTopicProbabilities.
+  // The traversal starts at the topic in the given slot of the tree.
+  // The visited slots and their unnormalized log probabilities are
+  // appended to slots and topic_pr in depth-first order.
   static void ProbabilitiesDfs(
-      Topic* topic,
+      Tree* tree,
+      int slot,
       Author* Author,
-      double* log_sum,
       vector<double>* path_pr,
-      int start_level);
+      const vector<double>& new_topic_pr,
+      int start_level,
+      vector<int>* slots,
+      vector<double>* topic_pr);
 
  private:
   // Log gamma ratio computation used to compute the
   // path probabilities.
+  // The log gamma values come from the tables of the tree.
+  // The slot is -1 for a new topic.
   static double LogGammaRatio(
+      Tree* tree,
       Author* Author,
-      Topic* topic,
-      int level,
-      double eta,
-      int term_no);
+      int slot,
+      int level);
 };
 
-// AllAuthors contains all the authors in corpus.
+// AllAuthors contains all the authors in corpus, and the word lists of
+// the authors.
 class AllAuthors {
-
-public:
-	static AllAuthors& GetInstance();
-
 public:
-	AllAuthors(const AllAuthors& from) = delete;
-	AllAuthors& operator=(const AllAuthors& from) = delete;
+	AllAuthors() {}
+	AllAuthors(const AllAuthors& from);
+	AllAuthors& operator=(const AllAuthors& from);
 
 	int getAuthors() const { return authors_.size(); }
 
 	Author* getMutableAuthor(int author_id) { return &authors_[author_id]; }
 
-	void addAuthor(int id, int depth) { authors_.emplace_back(Author(id, depth)); }
+	void addAuthor(int id, int depth);
+
+	AuthorWords* getMutableAuthorWords() { return &words_; }
 
 private:
+	// Point the authors to the word lists of this object.
+	void bindAuthorWords();
+
 	// All authors.
 	vector<Author> authors_;
 
-	// Private constructor.
-	AllAuthors() {}
+	// The word lists of all authors.
+	AuthorWords words_;
 };
 
 }  // namespace hatm
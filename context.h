@@ -0,0 +1,30 @@
+#ifndef CONTEXT_H_
+#define CONTEXT_H_
+
+#include "document.h"
+#include "author.h"
+
+namespace hatm {
+
+// The per-model state: all the words of the corpus, with their author
+// and level assignments, and all the authors with their topic paths.
+// Each Gibbs state owns its context, so several independent models can
+// be built, sampled and destroyed within one process.
+class ModelContext {
+ public:
+  ModelContext() {}
+
+  AllWords* getMutableAllWords() { return &all_words_; }
+  AllAuthors* getMutableAllAuthors() { return &all_authors_; }
+
+ private:
+  // All the words in the corpus.
+  AllWords all_words_;
+
+  // All the authors in the corpus.
+  AllAuthors all_authors_;
+};
+
+}  // namespace hatm
+
+#endif  // CONTEXT_H_
@@ -0,0 +1,42 @@
+#include <iostream>
+#include <thread>
+
+#include "corpus.h"
+
+using hatm::Corpus;
+using hatm::CorpusUtils;
+using hatm::ModelContext;
+
+using std::string;
+
+// The depth of the authors created while reading, which are not written.
+#define CONVERT_DEPTH 1
+
+int main(int argc, char** argv) {
+  if (argc == 4) {
+    string filename_corpus = argv[1];
+    string filename_authors = argv[2];
+    string filename_binary = argv[3];
+
+    int threads = std::thread::hardware_concurrency();
+    if (threads <= 0) {
+      threads = 1;
+    }
+
+    Corpus corpus;
+    ModelContext context;
+    if (!CorpusUtils::ReadCorpus(filename_corpus, filename_authors,
+                                 &corpus, &context, CONVERT_DEPTH,
+                                 threads) ||
+        !CorpusUtils::WriteBinaryCorpus(filename_binary, &corpus,
+                                         &context)) {
+      return 1;
+    }
+  } else {
+    cout << "Arguments: "
+        "(1) corpus filename "
+        "(2) authors filename "
+        "(3) binary corpus filename" << endl;
+  }
+  return 0;
+}
@@ -1,20 +1,34 @@
 
 #include <assert.h>
 #include <gsl/gsl_permutation.h>
+#include <gsl/gsl_sf.h>
 #include <math.h>
+#include <stdint.h>
+#include <string.h>
 
+#include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <iostream>
-#include <sstream>
 
 #include "corpus.h"
 #include "topic.h"
+#include "tree.h"
 #include "author.h"
+#include "parallel.h"
 
 #define REP_NO_GEM 100
 #define GEM_STDEV 0.05
 #define GEM_MEAN_STDEV 0.05
-#define BUF_SIZE 10000
+
+// The corpus files are split into this many chunks per reading thread,
+// so the workers can balance uneven lines.
+#define CHUNKS_PER_THREAD 4
+
+// The binary corpus format starts with this magic string, followed by
+// the version of the format.
+#define BINARY_CORPUS_MAGIC "HATMCORP"
+#define BINARY_CORPUS_VERSION 1
 
 namespace hatm {
 
@@ -42,84 +56,215 @@ Corpus::Corpus(double gem_mean, double gem_scale)
 // CorpusUtils
 // =======================================================================
 
-void CorpusUtils::ReadCorpus(
-    const std::string& docs_filename,
-    const std::string& authors_filename,
-    Corpus* corpus,
-    int depth) {
+// Return the end of the line starting at p, the newline or end.
+static const char* FindLineEnd(const char* p, const char* end) {
+  const char* line_end =
+      static_cast<const char*>(memchr(p, '\n', end - p));
+  return line_end == NULL ? end : line_end;
+}
 
-  ifstream infile(docs_filename.c_str());
-  char buf[BUF_SIZE];
+// Parse the next integer of the line [p, end), skipping the blanks
+// before it. Return the position after the integer, or NULL if the line
+// holds no further integer.
+static const char* ParseInt(const char* p, const char* end, int* value) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+    p++;
+  }
+  bool negative = false;
+  if (p < end && *p == '-') {
+    negative = true;
+    p++;
+  }
+  if (p == end || *p < '0' || *p > '9') {
+    return NULL;
+  }
+  int result = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    result = result * 10 + (*p - '0');
+    p++;
+  }
+  *value = negative ? -result : result;
+  return p;
+}
 
-  ifstream authors_infile(authors_filename.c_str());
-  char authors_buf[BUF_SIZE];
+// The documents parsed from a chunk of lines of the documents file.
+// The word ids and author ids of all documents of the chunk are stored
+// contiguously, with the offsets of each document's range; the
+// documents of a chunk are numbered from 0.
+struct CorpusChunk {
+  // The chunk of the documents file and the number of its first line.
+  const char* begin;
+  const char* end;
+  int first_line;
+
+  vector<int> word_ids;
+  vector<int> word_offsets;
+  vector<int> author_ids;
+  vector<int> author_offsets;
+
+  // One more than the largest word id and author id of the chunk.
+  int word_no;
+  int author_no;
+
+  int total_word_count;
+};
+
+// Split [begin, end) into chunks ranges which end at line boundaries.
+// bounds receives the chunks + 1 boundaries; some ranges may be empty.
+static void SplitLines(const char* begin, const char* end, int chunks,
+                       vector<const char*>* bounds) {
+  bounds->clear();
+  bounds->push_back(begin);
+  for (int i = 1; i < chunks; i++) {
+    const char* p = begin + (end - begin) * i / chunks;
+    if (p < bounds->back()) {
+      p = bounds->back();
+    }
+    p = FindLineEnd(p, end);
+    bounds->push_back(p < end ? p + 1 : end);
+  }
+  bounds->push_back(end);
+}
+
+// Return the number of lines starting in [begin, end), where end is a
+// line boundary.
+static int CountLines(const char* begin, const char* end) {
+  int lines = 0;
+  for (const char* p = begin; p < end; p = FindLineEnd(p, end) + 1) {
+    lines++;
+  }
+  return lines;
+}
+
+// Find the start of every line of [begin, end), in chunks on the
+// threads of the scheduler.
+static void IndexLines(const char* begin, const char* end, int chunks,
+                       TaskScheduler* scheduler,
+                       vector<const char*>* line_starts) {
+  vector<const char*> bounds;
+  SplitLines(begin, end, chunks, &bounds);
+
+  vector<int> first_lines(chunks + 1, 0);
+  scheduler->run(chunks, [&](int chunk, int /*worker*/) {
+    first_lines[chunk + 1] = CountLines(bounds[chunk], bounds[chunk + 1]);
+  });
+  for (int i = 0; i < chunks; i++) {
+    first_lines[i + 1] += first_lines[i];
+  }
+
+  line_starts->resize(first_lines[chunks]);
+  scheduler->run(chunks, [&](int chunk, int /*worker*/) {
+    const char* chunk_end = bounds[chunk + 1];
+    int line = first_lines[chunk];
+    for (const char* p = bounds[chunk]; p < chunk_end;
+         p = FindLineEnd(p, chunk_end) + 1) {
+      (*line_starts)[line++] = p;
+    }
+  });
+}
+
+// Parse the documents of a chunk of the documents file, together with
+// the same lines of the authors file. Like the whole corpus, a chunk
+// ends with the shorter of the two files, and lines without authors
+// are not documents.
+static void ParseChunk(const vector<const char*>& author_lines,
+                       const char* authors_end,
+                       CorpusChunk* chunk) {
+  chunk->word_offsets.assign(1, 0);
+  chunk->author_offsets.assign(1, 0);
+  chunk->word_no = 0;
+  chunk->author_no = 0;
+  chunk->total_word_count = 0;
+
+  int line = chunk->first_line;
+  const char* docs = chunk->begin;
+  while (docs < chunk->end &&
+         line < static_cast<int>(author_lines.size())) {
+    const char* docs_line_end = FindLineEnd(docs, chunk->end);
+    const char* authors = author_lines[line];
+    const char* authors_line_end = FindLineEnd(authors, authors_end);
+
+    int author_id;
+    const char* p = authors;
+    while ((p = ParseInt(p, authors_line_end, &author_id)) != NULL) {
+      if (author_id >= chunk->author_no) {
+        chunk->author_no = author_id + 1;
+      }
+      chunk->author_ids.push_back(author_id);
+    }
+
+    if (static_cast<int>(chunk->author_ids.size()) >
+        chunk->author_offsets.back()) {
+      // The line holds the number of distinct words, then word:count
+      // pairs.
+      int words;
+      p = ParseInt(docs, docs_line_end, &words);
+      int word_id, word_count;
+      while (p != NULL &&
+             (p = ParseInt(p, docs_line_end, &word_id)) != NULL) {
+        word_count = 0;
+        if (p < docs_line_end && *p == ':') {
+          p = ParseInt(p + 1, docs_line_end, &word_count);
+          if (p == NULL) {
+            word_count = 0;
+            p = docs_line_end;
+          }
+        }
+        chunk->total_word_count += word_count;
 
-  int author_no = 0;
-  int doc_no = 0;
-  int word_no = 0;
-  int total_word_count = 0;
-  int words;
-
-  AllWords& all_words = AllWords::GetInstance();
-
-  while (infile.getline(buf, BUF_SIZE) && 
-  			 authors_infile.getline(authors_buf, BUF_SIZE)) {
-  	
-  	istringstream s_line_author(authors_buf);
-    std::vector<int> author_ids;
-  	while (s_line_author.getline(authors_buf, BUF_SIZE, ' ')) {
-  		int author_id = atoi(authors_buf);
-  		if (author_id >= author_no) {
-  			author_no = author_id + 1;
-  		}
-  		author_ids.push_back(author_id);
-  	}
-
-  	if (author_ids.empty()) {
-  		continue;
-  	}
-
-    istringstream s_line(buf);
-    // Consider each line at a time.
-    int word_count_pos = 0;
-    Document document(doc_no);
-    // Set author ids
-    document.setAuthorIds(author_ids);
-    while (s_line.getline(buf, BUF_SIZE, ' ')) {
-      if (word_count_pos == 0) {
-        words = atoi(buf);
-      } else {
-        int word_id, word_count;
-        istringstream s_word_count(buf);
-        string str;
-        getline(s_word_count, str, ':');
-        word_id = atoi(str.c_str());
-        getline(s_word_count, str, ':');
-        word_count = atoi(str.c_str());
-        total_word_count += word_count;
-       
         for (int i = 0; i < word_count; i++) {
-          all_words.addWord(word_id);
-          document.addWord(all_words.getWordNo() - 1);
+          chunk->word_ids.push_back(word_id);
         }
-       
-        if (word_id >= word_no) {
-          word_no = word_id + 1;
+
+        if (word_id >= chunk->word_no) {
+          chunk->word_no = word_id + 1;
         }
       }
-      word_count_pos++;
+      chunk->word_offsets.push_back(chunk->word_ids.size());
+      chunk->author_offsets.push_back(chunk->author_ids.size());
     }
-    corpus->addDocument(move(document));
-    doc_no += 1;
+
+    docs = docs_line_end + 1;
+    line++;
   }
+}
 
-  infile.close();
-  authors_infile.close();
+// Build the documents doc_id, doc_id + 1, ... from the word ids and
+// author ids of docs documents, stored contiguously with the offsets of
+// each document's range. Word k of word_ids is stored at index
+// first_word + k of all_words, which must have room for it.
+static void BuildDocuments(int docs, int doc_id,
+                           const int* word_ids, const int* word_offsets,
+                           const int* author_ids, const int* author_offsets,
+                           int first_word, AllWords* all_words,
+                           vector<Document>* documents) {
+  documents->reserve(documents->size() + docs);
+  for (int d = 0; d < docs; d++) {
+    Document document(doc_id + d);
+    document.setAuthorIds(vector<int>(author_ids + author_offsets[d],
+                                      author_ids + author_offsets[d + 1]));
+    vector<int> words;
+    words.reserve(word_offsets[d + 1] - word_offsets[d]);
+    for (int k = word_offsets[d]; k < word_offsets[d + 1]; k++) {
+      all_words->setId(first_word + k, word_ids[k]);
+      words.push_back(first_word + k);
+    }
+    document.setWords(move(words));
+    documents->emplace_back(move(document));
+  }
+}
 
-  AllAuthors& all_authors = AllAuthors::GetInstance();
+// Add the authors of a corpus just read to the context, set the counts
+// of the corpus and print them.
+static void SetCorpusCounts(Corpus* corpus, ModelContext* context,
+                            int depth, int doc_no, int author_no,
+                            int word_no, long total_word_count) {
+  AllAuthors* all_authors = context->getMutableAllAuthors();
   for (int i = 0; i < author_no; i++) {
-    all_authors.addAuthor(i, depth);
+    all_authors->addAuthor(i, depth);
   }
+  all_authors->getMutableAuthorWords()->resizeWords(
+      context->getMutableAllWords()->getWordNo());
 
   corpus->setWordNo(word_no);
   corpus->setAuthorNo(author_no);
@@ -128,27 +273,322 @@ void CorpusUtils::ReadCorpus(
   cout << "Number of authors in corpus: " << author_no << endl;
   cout << "Number of distinct words in corpus: " << word_no << endl;
   cout << "Number of words in corpus: " << total_word_count << " = " 
-       << all_words.getWordNo() << endl;
+       << context->getMutableAllWords()->getWordNo() << endl;
+}
+
+bool CorpusUtils::ReadCorpus(
+    const std::string& docs_filename,
+    const std::string& authors_filename,
+    Corpus* corpus,
+    ModelContext* context,
+    int depth,
+    int threads) {
+
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+  // The files are parsed in place.
+  MappedFile docs_file(docs_filename);
+  MappedFile authors_file(authors_filename);
+  if (!docs_file.isOpen() || !authors_file.isOpen()) {
+    cerr << "Cannot read " << docs_filename << " or "
+         << authors_filename << endl;
+    return false;
+  }
+  const char* docs = docs_file.getData();
+  const char* docs_end = docs + docs_file.getSize();
+  const char* authors = authors_file.getData();
+  const char* authors_end = authors + authors_file.getSize();
+
+  TaskScheduler scheduler(threads);
+  int chunk_no = threads * CHUNKS_PER_THREAD;
+
+  // Line i of the documents file goes with line i of the authors file,
+  // so the chunks of the documents file find their author lines in an
+  // index of the line starts of the authors file.
+  vector<const char*> author_lines;
+  IndexLines(authors, authors_end, chunk_no, &scheduler, &author_lines);
+
+  vector<const char*> bounds;
+  SplitLines(docs, docs_end, chunk_no, &bounds);
+  vector<CorpusChunk> chunks(chunk_no);
+  scheduler.run(chunk_no, [&](int chunk, int /*worker*/) {
+    chunks[chunk].begin = bounds[chunk];
+    chunks[chunk].end = bounds[chunk + 1];
+    chunks[chunk].first_line = CountLines(bounds[chunk], bounds[chunk + 1]);
+  });
+  int line_no = 0;
+  for (int i = 0; i < chunk_no; i++) {
+    int lines = chunks[i].first_line;
+    chunks[i].first_line = line_no;
+    line_no += lines;
+  }
+
+  scheduler.run(chunk_no, [&](int chunk, int /*worker*/) {
+    ParseChunk(author_lines, authors_end, &chunks[chunk]);
+  });
+
+  // The first document id and word index of each chunk, and the
+  // maximum over the chunks of the counts.
+  vector<int> doc_offsets(chunk_no + 1, 0);
+  vector<int> word_offsets(chunk_no + 1, 0);
+  int author_no = 0;
+  int word_no = 0;
+  int total_word_count = 0;
+  for (int i = 0; i < chunk_no; i++) {
+    doc_offsets[i + 1] = doc_offsets[i] + chunks[i].word_offsets.size() - 1;
+    word_offsets[i + 1] = word_offsets[i] + chunks[i].word_ids.size();
+    author_no = max(author_no, chunks[i].author_no);
+    word_no = max(word_no, chunks[i].word_no);
+    total_word_count += chunks[i].total_word_count;
+  }
+  int doc_no = doc_offsets[chunk_no];
+
+  // Stitch the chunks into the words and documents of the corpus.
+  AllWords* all_words = context->getMutableAllWords();
+  int first_word = all_words->getWordNo();
+  all_words->resizeWords(first_word + word_offsets[chunk_no], author_no);
+  vector<vector<Document> > documents(chunk_no);
+  scheduler.run(chunk_no, [&](int chunk, int /*worker*/) {
+    CorpusChunk* c = &chunks[chunk];
+    BuildDocuments(c->word_offsets.size() - 1, doc_offsets[chunk],
+                   c->word_ids.data(), c->word_offsets.data(),
+                   c->author_ids.data(), c->author_offsets.data(),
+                   first_word + word_offsets[chunk], all_words,
+                   &documents[chunk]);
+    vector<int>().swap(c->word_ids);
+    vector<int>().swap(c->author_ids);
+  });
+  for (int i = 0; i < chunk_no; i++) {
+    for (Document& document : documents[i]) {
+      corpus->addDocument(move(document));
+    }
+  }
+
+  double seconds = chrono::duration<double>(
+      chrono::steady_clock::now() - start).count();
+  double megabytes =
+      (docs_file.getSize() + authors_file.getSize()) / 1048576.0;
+  cout << "Read " << megabytes << " MB in " << seconds << " s ("
+       << (seconds > 0.0 ? megabytes / seconds : 0.0) << " MB/s) on "
+       << threads << " threads" << endl;
+
+  SetCorpusCounts(corpus, context, depth, doc_no, author_no, word_no,
+                  total_word_count);
+  return true;
+}
+
+// The header of a corpus in the binary format. It is followed by four
+// arrays of int32_t: the offsets of the words of each document
+// (doc_no + 1 values), the word ids of all words (word_count values),
+// the offsets of the author ids of each document (doc_no + 1 values)
+// and the author ids of all documents (author_id_count values).
+// Values are stored in the byte order of the machine writing them.
+struct BinaryCorpusHeader {
+  char magic[8];
+  int32_t version;
+  int32_t doc_no;
+  int32_t author_no;
+  int32_t word_no;
+  int64_t word_count;
+  int64_t author_id_count;
+};
+
+bool CorpusUtils::IsBinaryCorpus(const std::string& filename) {
+  ifstream infile(filename.c_str(), ios::binary);
+  char magic[sizeof(BINARY_CORPUS_MAGIC) - 1];
+  return infile.read(magic, sizeof(magic)) &&
+      memcmp(magic, BINARY_CORPUS_MAGIC, sizeof(magic)) == 0;
+}
+
+bool CorpusUtils::WriteBinaryCorpus(
+    const std::string& filename,
+    Corpus* corpus,
+    ModelContext* context) {
+  AllWords* all_words = context->getMutableAllWords();
+
+  vector<int32_t> word_offsets(1, 0);
+  vector<int32_t> word_ids;
+  vector<int32_t> author_offsets(1, 0);
+  vector<int32_t> author_ids;
+  for (int d = 0; d < corpus->getDocuments(); d++) {
+    Document* document = corpus->getMutableDocument(d);
+    for (int i = 0; i < document->getWords(); i++) {
+      word_ids.push_back(
+          all_words->getId(document->getWord(i)));
+    }
+    for (int i = 0; i < document->getAuthors(); i++) {
+      author_ids.push_back(document->getAuthorId(i));
+    }
+    word_offsets.push_back(word_ids.size());
+    author_offsets.push_back(author_ids.size());
+  }
+
+  // The offsets are stored as int32_t.
+  if (word_ids.size() > static_cast<size_t>(INT32_MAX) ||
+      author_ids.size() > static_cast<size_t>(INT32_MAX)) {
+    cerr << "Too many words for the binary corpus format: "
+         << word_ids.size() << endl;
+    return false;
+  }
+
+  BinaryCorpusHeader header;
+  memcpy(header.magic, BINARY_CORPUS_MAGIC, sizeof(header.magic));
+  header.version = BINARY_CORPUS_VERSION;
+  header.doc_no = corpus->getDocuments();
+  header.author_no = corpus->getAuthorNo();
+  header.word_no = corpus->getWordNo();
+  header.word_count = word_ids.size();
+  header.author_id_count = author_ids.size();
+
+  ofstream outfile(filename.c_str(), ios::binary | ios::trunc);
+  outfile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  const vector<int32_t>* arrays[] = {
+    &word_offsets, &word_ids, &author_offsets, &author_ids
+  };
+  for (const vector<int32_t>* array : arrays) {
+    outfile.write(reinterpret_cast<const char*>(array->data()),
+                  array->size() * sizeof(int32_t));
+  }
+  outfile.close();
+  if (!outfile) {
+    cerr << "Cannot write " << filename << endl;
+    return false;
+  }
+  return true;
+}
+
+// Check that the offsets of the documents [begin, end) do not decrease
+// and stay in [0, id_count], and that the ids in their ranges are in
+// [0, id_no).
+static bool CheckBinaryRanges(const int32_t* offsets, const int32_t* ids,
+                              int begin, int end, long id_count,
+                              int id_no) {
+  if (offsets[begin] < 0 || offsets[end] > id_count) {
+    return false;
+  }
+  for (int d = begin; d < end; d++) {
+    if (offsets[d + 1] < offsets[d]) {
+      return false;
+    }
+  }
+  for (int k = offsets[begin]; k < offsets[end]; k++) {
+    if (ids[k] < 0 || ids[k] >= id_no) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool CorpusUtils::ReadBinaryCorpus(
+    const std::string& filename,
+    Corpus* corpus,
+    ModelContext* context,
+    int depth,
+    int threads) {
+
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+  // The arrays are used in place, from the mapping of the file.
+  MappedFile file(filename);
+  const char* data = file.getData();
+  BinaryCorpusHeader header;
+  bool valid = file.getSize() >= sizeof(header);
+  if (valid) {
+    memcpy(&header, data, sizeof(header));
+    valid = memcmp(header.magic, BINARY_CORPUS_MAGIC,
+                   sizeof(header.magic)) == 0 &&
+        header.version == BINARY_CORPUS_VERSION &&
+        header.doc_no >= 0 && header.author_no >= 0 &&
+        header.word_no >= 0 &&
+        header.word_count >= 0 && header.word_count <= INT32_MAX &&
+        header.author_id_count >= 0 &&
+        header.author_id_count <= INT32_MAX &&
+        file.getSize() == sizeof(header) + sizeof(int32_t) *
+            (2 * (header.doc_no + 1L) + header.word_count +
+             header.author_id_count);
+  }
+  if (!valid) {
+    cerr << "Cannot read binary corpus " << filename << endl;
+    return false;
+  }
+  const int32_t* word_offsets =
+      reinterpret_cast<const int32_t*>(data + sizeof(header));
+  const int32_t* word_ids = word_offsets + header.doc_no + 1;
+  const int32_t* author_offsets = word_ids + header.word_count;
+  const int32_t* author_ids = author_offsets + header.doc_no + 1;
+
+  // The documents are split into chunks of consecutive documents, each
+  // checked and then built on a thread into its own list. The offsets
+  // must run from 0 to the counts of the header without decreasing, so
+  // the chunks only look at the ids of their own documents.
+  TaskScheduler scheduler(threads);
+  int chunk_no = threads * CHUNKS_PER_THREAD;
+  vector<char> chunk_valid(chunk_no, 1);
+  scheduler.run(chunk_no, [&](int chunk, int /*worker*/) {
+    int begin = static_cast<long>(header.doc_no) * chunk / chunk_no;
+    int end = static_cast<long>(header.doc_no) * (chunk + 1) / chunk_no;
+    chunk_valid[chunk] =
+        CheckBinaryRanges(word_offsets, word_ids, begin, end,
+                          header.word_count, header.word_no) &&
+        CheckBinaryRanges(author_offsets, author_ids, begin, end,
+                          header.author_id_count, header.author_no);
+  });
+  valid = word_offsets[0] == 0 &&
+      word_offsets[header.doc_no] == header.word_count &&
+      author_offsets[0] == 0 &&
+      author_offsets[header.doc_no] == header.author_id_count &&
+      find(chunk_valid.begin(), chunk_valid.end(), 0) == chunk_valid.end();
+  if (!valid) {
+    cerr << "Invalid offsets or ids in binary corpus " << filename << endl;
+    return false;
+  }
+  AllWords* all_words = context->getMutableAllWords();
+  int first_word = all_words->getWordNo();
+  all_words->resizeWords(first_word + header.word_count,
+                         header.author_no);
+  vector<vector<Document> > documents(chunk_no);
+  scheduler.run(chunk_no, [&](int chunk, int /*worker*/) {
+    int begin = static_cast<long>(header.doc_no) * chunk / chunk_no;
+    int end = static_cast<long>(header.doc_no) * (chunk + 1) / chunk_no;
+    BuildDocuments(end - begin, begin, word_ids, word_offsets + begin,
+                   author_ids, author_offsets + begin, first_word,
+                   all_words, &documents[chunk]);
+  });
+  for (int i = 0; i < chunk_no; i++) {
+    for (Document& document : documents[i]) {
+      corpus->addDocument(move(document));
+    }
+  }
+
+  double seconds = chrono::duration<double>(
+      chrono::steady_clock::now() - start).count();
+  double megabytes = file.getSize() / 1048576.0;
+  cout << "Read " << megabytes << " MB in " << seconds << " s ("
+       << (seconds > 0.0 ? megabytes / seconds : 0.0) << " MB/s) on "
+       << threads << " threads" << endl;
+
+  SetCorpusCounts(corpus, context, depth, header.doc_no, header.author_no,
+                  header.word_no, header.word_count);
+  return true;
 }
 
 double CorpusUtils::GemScore(
-    Corpus* corpus) {
+    Corpus* corpus,
+    AllAuthors* all_authors) {
   double score = 0.0;
 
-  AllAuthors& all_authors = AllAuthors::GetInstance();
-
   // Get depth of the tree.
   // Look at the topic in the topic path of the document.
   int depth =
-      all_authors.getMutableAuthor(0)->
+      all_authors->getMutableAuthor(0)->
       getMutablePathTopic(0)->getMutableTree()->getDepth();
 
   // GEM distribution priors.
   double prior_a = (1 - corpus->getGemMean()) * corpus->getGemScale();
   double prior_b = corpus->getGemMean() * corpus->getGemScale();
 
-  for (int i = 0; i < all_authors.getAuthors(); i++) {
-    Author* author = all_authors.getMutableAuthor(i);
+  for (int i = 0; i < all_authors->getAuthors(); i++) {
+    Author* author = all_authors->getMutableAuthor(i);
     assert(author != NULL);
 
     double author_score = 0.0;
@@ -172,9 +612,11 @@ double CorpusUtils::GemScore(
       double a = author->getLevelCounts(j) + prior_a;
       double b = agreg_level_count[j] + prior_b;
 
-      author_score += lgamma(a) + lgamma(b) - lgamma(a + b) -
-          lgamma(prior_b) - lgamma(prior_a) +
-          lgamma(prior_a + prior_b);
+      // gsl_sf_lngamma, unlike lgamma, does not set the global signgam,
+      // so the score can be computed by concurrent chains.
+      author_score += gsl_sf_lngamma(a) + gsl_sf_lngamma(b) -
+          gsl_sf_lngamma(a + b) - gsl_sf_lngamma(prior_b) -
+          gsl_sf_lngamma(prior_a) + gsl_sf_lngamma(prior_a + prior_b);
 
       sum_levels -= author->getLevelCounts(j);
 
@@ -204,8 +646,8 @@ double CorpusUtils::GemScore(
   return score;
 }
 
-void CorpusUtils::UpdateGemScale(Corpus* corpus) {
-  double current_gem_score = GemScore(corpus);
+int CorpusUtils::UpdateGemScale(Corpus* corpus, AllAuthors* all_authors) {
+  double current_gem_score = GemScore(corpus, all_authors);
 
   int score_change = 0;
 
@@ -218,9 +660,12 @@ void CorpusUtils::UpdateGemScale(Corpus* corpus) {
     // Decide if to keep the new GEM scale value.
     if (new_gem_scale > 0) {
       corpus->setGemScale(new_gem_scale);
-      double new_gem_score = GemScore(corpus);
+      double new_gem_score = GemScore(corpus, all_authors);
+
+      // The log ratio is tempered like the conditionals of the chain.
       double rand = Utils::RandNo();
-      if (rand > exp(new_gem_score - current_gem_score)) {
+      if (rand > exp(Utils::GetInverseTemperature() *
+                     (new_gem_score - current_gem_score))) {
         corpus->setGemScale(old_gem_scale);
       } else {
         current_gem_score = new_gem_score;
@@ -228,12 +673,11 @@ void CorpusUtils::UpdateGemScale(Corpus* corpus) {
       }
     }
   }
-  cout << "Gem scale: (1) score_change: " << score_change <<
-        " (2) new_gem_scale: " << corpus->getGemScale() << endl;
+  return score_change;
 }
 
-void CorpusUtils::UpdateGemMean(Corpus* corpus) {
-  double current_gem_score = GemScore(corpus);
+int CorpusUtils::UpdateGemMean(Corpus* corpus, AllAuthors* all_authors) {
+  double current_gem_score = GemScore(corpus, all_authors);
 
   int score_change = 0;
 
@@ -246,9 +690,10 @@ void CorpusUtils::UpdateGemMean(Corpus* corpus) {
     // Decide if to keep the new GEM mean value.
     if (new_gem_mean > 0 && new_gem_mean < 1) {
       corpus->setGemMean(new_gem_mean);
-      double new_gem_score = GemScore(corpus);
+      double new_gem_score = GemScore(corpus, all_authors);
       double rand = Utils::RandNo();
-      if (rand > exp(new_gem_score - current_gem_score)) {
+      if (rand > exp(Utils::GetInverseTemperature() *
+                     (new_gem_score - current_gem_score))) {
         corpus->setGemMean(old_gem_mean);
       } else {
         current_gem_score = new_gem_score;
@@ -256,8 +701,7 @@ void CorpusUtils::UpdateGemMean(Corpus* corpus) {
       }
     }
   }
-  cout << "Gem mean: (1) score_change: " << score_change <<
-      " (2) new_gem_mean: " << corpus->getGemMean() << endl;
+  return score_change;
 }
 
 void CorpusUtils::PermuteDocuments(Corpus* corpus) {
@@ -282,5 +726,55 @@ void CorpusUtils::PermuteDocuments(Corpus* corpus) {
   gsl_permutation_free(perm);
 }
 
+void CorpusUtils::GroupWordsByAuthor(Corpus* corpus, ModelContext* context,
+                                     TaskScheduler* scheduler) {
+  AllWords* all_words = context->getMutableAllWords();
+  AllAuthors* all_authors = context->getMutableAllAuthors();
+  int word_no = all_words->getWordNo();
+  int author_no = all_authors->getAuthors();
+  int doc_no = corpus->getDocuments();
+  int chunk_no = scheduler->getThreads() * CHUNKS_PER_THREAD;
+
+  // The new index of the first word of each author.
+  vector<int> firsts(author_no + 1, 0);
+  for (int i = 0; i < author_no; i++) {
+    firsts[i + 1] = firsts[i] + all_authors->getMutableAuthor(i)->getWords();
+  }
+
+  // The new index of each word, assigned in chunks of authors.
+  vector<int> new_index(word_no, -1);
+  scheduler->run(chunk_no, [&](int chunk, int /*worker*/) {
+    int begin = static_cast<long>(author_no) * chunk / chunk_no;
+    int end = static_cast<long>(author_no) * (chunk + 1) / chunk_no;
+    for (int i = begin; i < end; i++) {
+      Author* author = all_authors->getMutableAuthor(i);
+      for (int j = 0; j < author->getWords(); j++) {
+        new_index[author->getWord(j)] = firsts[i] + j;
+      }
+    }
+  });
+  int next = firsts[author_no];
+  for (int i = 0; next < word_no && i < word_no; i++) {
+    if (new_index[i] == -1) {
+      new_index[i] = next++;
+    }
+  }
+  all_words->permute(new_index);
+  all_authors->getMutableAuthorWords()->renumber(new_index);
+
+  scheduler->run(chunk_no, [&](int chunk, int /*worker*/) {
+    int begin = static_cast<long>(doc_no) * chunk / chunk_no;
+    int end = static_cast<long>(doc_no) * (chunk + 1) / chunk_no;
+    for (int i = begin; i < end; i++) {
+      Document* document = corpus->getMutableDocument(i);
+      vector<int> words(document->getWords());
+      for (int j = 0; j < document->getWords(); j++) {
+        words[j] = new_index[document->getWord(j)];
+      }
+      document->setWords(move(words));
+    }
+  });
+}
+
 }  // namespace hatm
 
@@ -6,10 +6,13 @@
 
 #include "document.h"
 #include "author.h"
+#include "context.h"
 #include "utils.h"
 
 namespace hatm {
 
+class TaskScheduler;
+
 // A corpus containing a number of documents.
 // The parameters of the GEM distribution: gem_mean_ and
 // gem_scale_ are also defined at the corpus level.
@@ -64,28 +67,78 @@ class Corpus {
 class CorpusUtils {
  public:
   // Read corpus from file.
-  static void ReadCorpus(
+  // The words and authors are added to the model context.
+  // The files are split into chunks of lines which are parsed on the
+  // given number of threads, and the chunks are then stitched together
+  // in order, so the documents and words are numbered as if the files
+  // were read line by line.
+  // Return false if the files cannot be read.
+  static bool ReadCorpus(
       const std::string& docs_filename,
       const std::string& authors_filename,
       Corpus* corpus,
-      int depth);
+      ModelContext* context,
+      int depth,
+      int threads);
+
+  // Return whether the file holds a corpus in the binary format written
+  // by WriteBinaryCorpus.
+  static bool IsBinaryCorpus(const std::string& filename);
+
+  // Write the documents of the corpus, with the word ids of their words
+  // in the context, in the binary format: a versioned header with the
+  // numbers of documents, authors and distinct words, then the words
+  // and the authors of the documents as offset and id arrays.
+  // The offsets are 32-bit, so corpora of more than INT32_MAX words or
+  // author ids are not written.
+  // Return false if the file cannot be written.
+  static bool WriteBinaryCorpus(
+      const std::string& filename,
+      Corpus* corpus,
+      ModelContext* context);
+
+  // Read a corpus written by WriteBinaryCorpus, like ReadCorpus. The
+  // file is mapped and its arrays copied into the documents and words
+  // on the given number of threads, without parsing. The offsets and
+  // ids are checked against the header before any document is built.
+  // Return false if the file is not a valid binary corpus.
+  static bool ReadBinaryCorpus(
+      const std::string& filename,
+      Corpus* corpus,
+      ModelContext* context,
+      int depth,
+      int threads);
 
   // Corpus level GEM score.
   static double GemScore(
-      Corpus* corpus);
+      Corpus* corpus,
+      AllAuthors* all_authors);
 
   // Update the GEM scale parameter.
   // The new GEM scale parameter is based on Gaussian random variates.
-  // Repeat REP_NO_GEM number of times.
-  static void UpdateGemScale(Corpus* corpus);
+  // Repeat REP_NO_GEM number of times. The Metropolis-Hastings steps
+  // target the posterior raised to the inverse temperature of the
+  // calling thread (see Utils::SetInverseTemperature). Returns the
+  // number of accepted proposals.
+  static int UpdateGemScale(Corpus* corpus, AllAuthors* all_authors);
 
   // Update the GEM scale parameter.
   // The new GEM scale parameter is based on Gaussian random variates.
-  // Repeat REP_NO_GEM number of times.
-  static void UpdateGemMean(Corpus* corpus);
+  // Repeat REP_NO_GEM number of times. Tempered like UpdateGemScale.
+  // Returns the number of accepted proposals.
+  static int UpdateGemMean(Corpus* corpus, AllAuthors* all_authors);
 
   // Permute the documents in the corpus.
   static void PermuteDocuments(Corpus* corpus);
+
+  // Lay the words of the context out again so the words of each author
+  // are contiguous, in the order of the words of the author, followed by
+  // the words without an author. The words of the documents and the
+  // authors are renumbered and the word lists of the authors compacted;
+  // the topics are not affected. The new indices and the words of the
+  // documents are computed on the threads of the scheduler.
+  static void GroupWordsByAuthor(Corpus* corpus, ModelContext* context,
+                                 TaskScheduler* scheduler);
 };
 
 }  // namespace hatm
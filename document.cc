@@ -7,70 +7,81 @@
 #include "utils.h"
 #include "author.h"
 #include "tree.h"
+#include "context.h"
 
 namespace hatm {
 
-// =======================================================================
-// Word
-// =======================================================================
-
-Word::Word(int id, int author_id, int level)
-		: id_(id),
-		  author_id_(author_id),
-		  level_(level) {
-}
-
-Word::Word(int id) 
-		: id_(id),
-		  author_id_(-1),
-		  level_(-1) {
-
-}
-
-bool Word::operator==(const Word& word) {
-	return (id_ == word.id_) and
-				 (author_id_ == word.author_id_) and
-				 (level_ == word.level_);
-}
-
 // =======================================================================
 // WordUtils
 // =======================================================================
 
 void WordUtils::UpdateAuthorFromWord(
+			ModelContext* context,
 			int word,
 			int update) {
-	AllWords& all_words = AllWords::GetInstance();
-	Word* word_ptr = all_words.getMutableWord(word);
+	AllWords* all_words = context->getMutableAllWords();
 
-	if (word_ptr->getAuthorId() == -1 && update == -1) {
+	if (all_words->getAuthorId(word) == -1 && update == -1) {
 			return;
 	}
 
-	AllAuthors& all_authors = AllAuthors::GetInstance();
-	Author* author = all_authors.getMutableAuthor(word_ptr->getAuthorId());
+	Author* author = context->getMutableAllAuthors()->getMutableAuthor(
+			all_words->getAuthorId(word));
 	if (update == -1) {	
-		int level = word_ptr->getLevel();
+		int level = all_words->getLevel(word);
 		if (level != -1) {
 			// Update level count.
 			author->updateLevelCounts(level, update);	
 
 			// Update topic statistics.
-			author->getMutablePathTopic(level)->updateWordCount(word_ptr->getId(), -1);
+			author->getMutablePathTopic(level)->updateWordCount(all_words->getId(word), -1);
 		}
 		
 		// Remove word from author.
 		author->removeWord(word);
 
 		// Reset author id and level.
-		word_ptr->setAuthorId(-1);
-		word_ptr->setLevel(-1);
+		all_words->setAuthorId(word, -1);
+		all_words->setLevel(word, -1);
 		return;
 	}
 
 	if (update == 1) {
 		author->addWord(word);
-		word_ptr->setLevel(-1);
+		all_words->setLevel(word, -1);
+	}
+}
+
+void WordUtils::RemoveMovesFromAuthor(
+			ModelContext* context,
+			int author_id,
+			const vector<const AuthorMove*>& moves) {
+	Author* author = context->getMutableAllAuthors()->getMutableAuthor(author_id);
+	AllWords* all_words = context->getMutableAllWords();
+
+	for (size_t i = 0; i < moves.size(); i++) {
+		const AuthorMove* move = moves[i];
+		if (move->old_level != -1) {
+			// Update level count and topic statistics.
+			author->updateLevelCounts(move->old_level, -1);
+			author->getMutablePathTopic(move->old_level)->updateWordCount(
+					all_words->getId(move->word), -1);
+		}
+		author->removeWord(move->word);
+	}
+}
+
+void WordUtils::AddMovesToAuthor(
+			ModelContext* context,
+			int author_id,
+			const vector<const AuthorMove*>& moves) {
+	Author* author = context->getMutableAllAuthors()->getMutableAuthor(author_id);
+	AllWords* all_words = context->getMutableAllWords();
+
+	for (size_t i = 0; i < moves.size(); i++) {
+		all_words->setAuthorId(moves[i]->word, author_id);
+		all_words->setLevel(moves[i]->word, -1);
+		author->addWord(moves[i]->word);
 	}
 }
 
@@ -78,9 +89,73 @@ void WordUtils::UpdateAuthorFromWord(
 // AllWords
 // =======================================================================
 
-AllWords& AllWords::GetInstance() {
-	static AllWords instance;
-	return instance;
+AllWords::AllWords()
+		: word_no_(0),
+		  author_id_bytes_(1) {
+}
+
+void AllWords::resizeWords(int word_no, int author_no) {
+	int author_id_bytes = author_no < UINT8_MAX ? 1 :
+			(author_no < UINT16_MAX ? 2 : 4);
+	if (author_id_bytes > author_id_bytes_) {
+		// Widen the author ids of the current words.
+		vector<int> author_ids(word_no_);
+		for (int i = 0; i < word_no_; i++) {
+			author_ids[i] = getAuthorId(i);
+		}
+		vector<uint8_t>().swap(author_ids8_);
+		vector<uint16_t>().swap(author_ids16_);
+		vector<uint32_t>().swap(author_ids32_);
+		author_id_bytes_ = author_id_bytes;
+		switch (author_id_bytes_) {
+			case 2: author_ids16_.resize(word_no_); break;
+			default: author_ids32_.resize(word_no_); break;
+		}
+		for (int i = 0; i < word_no_; i++) {
+			setAuthorId(i, author_ids[i]);
+		}
+	}
+
+	ids_.resize(word_no, -1);
+	id_counts_.clear();
+	levels_.resize(word_no, static_cast<uint8_t>(-1));
+	switch (author_id_bytes_) {
+		case 1: author_ids8_.resize(word_no, static_cast<uint8_t>(-1)); break;
+		case 2: author_ids16_.resize(word_no, static_cast<uint16_t>(-1)); break;
+		default: author_ids32_.resize(word_no, static_cast<uint32_t>(-1)); break;
+	}
+	word_no_ = word_no;
+}
+
+const vector<long>& AllWords::getIdCounts(int vocabulary_no) {
+	if (static_cast<int>(id_counts_.size()) != vocabulary_no) {
+		id_counts_.assign(vocabulary_no, 0);
+		for (int i = 0; i < word_no_; i++) {
+			if (ids_[i] >= 0 && ids_[i] < vocabulary_no) {
+				id_counts_[ids_[i]]++;
+			}
+		}
+	}
+	return id_counts_;
+}
+
+// Move the values of an array to the indices of a permutation.
+template <typename T>
+static void PermuteArray(const vector<int>& new_index, vector<T>* values) {
+	if (values->empty()) return;
+	vector<T> permuted(values->size());
+	for (size_t i = 0; i < values->size(); i++) {
+		permuted[new_index[i]] = (*values)[i];
+	}
+	values->swap(permuted);
+}
+
+void AllWords::permute(const vector<int>& new_index) {
+	PermuteArray(new_index, &ids_);
+	PermuteArray(new_index, &levels_);
+	PermuteArray(new_index, &author_ids8_);
+	PermuteArray(new_index, &author_ids16_);
+	PermuteArray(new_index, &author_ids32_);
 }
 
 
@@ -139,23 +214,47 @@ void DocumentUtils::PermuteAuthors(Document* document) {
 	gsl_permutation_free(perm);
 }
 
-void DocumentUtils::SampleAuthors(Document* document) {
+void DocumentUtils::SampleAuthors(ModelContext* context, Document* document) {
 	int authors = document->getAuthors();
 	std::vector<double> log_pr(authors, log(1.0 / authors));
 	
-	AllWords& all_words = AllWords::GetInstance();
+	AllWords* all_words = context->getMutableAllWords();
 
 	for (int i = 0; i < document->getWords(); i++) {
 		int word_idx = document->getWord(i);
-		Word* word = all_words.getMutableWord(word_idx);
 
 
 		// Sample author id uniformly.
-		int author_id = Utils::SampleFromLogPr(log_pr);
-		if (author_id != word->getAuthorId()) {
-			WordUtils::UpdateAuthorFromWord(word_idx, -1);
-			word->setAuthorId(author_id);
-			WordUtils::UpdateAuthorFromWord(word_idx, 1);	
+		int author_id = document->getAuthorId(Utils::SampleFromLogPr(log_pr));
+		if (author_id != all_words->getAuthorId(word_idx)) {
+			WordUtils::UpdateAuthorFromWord(context, word_idx, -1);
+			all_words->setAuthorId(word_idx, author_id);
+			WordUtils::UpdateAuthorFromWord(context, word_idx, 1);	
+		}
+	}
+}
+
+void DocumentUtils::SampleAuthorMoves(
+			ModelContext* context,
+			Document* document,
+			vector<AuthorMove>* moves) {
+	int authors = document->getAuthors();
+	std::vector<double> log_pr(authors, log(1.0 / authors));
+
+	AllWords* all_words = context->getMutableAllWords();
+
+	for (int i = 0; i < document->getWords(); i++) {
+		int word_idx = document->getWord(i);
+
+		// Sample author id uniformly.
+		int author_id = document->getAuthorId(Utils::SampleFromLogPr(log_pr));
+		if (author_id != all_words->getAuthorId(word_idx)) {
+			AuthorMove move;
+			move.word = word_idx;
+			move.old_author_id = all_words->getAuthorId(word_idx);
+			move.old_level = all_words->getLevel(word_idx);
+			move.new_author_id = author_id;
+			moves->push_back(move);
 		}
 	}
 }
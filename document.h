@@ -1,6 +1,8 @@
 #ifndef DOCUMENT_H_
 #define DOCUMENT_H_
 
+#include <stdint.h>
+
 #include <string>
 #include <vector>
 
@@ -8,71 +10,115 @@ using namespace std;
 
 namespace hatm {
 
-// A word having an id, a word count, author id,
-// and the level in the tree the word is assigned to.
-class Word {
-public:
-	Word(int id, int author_id, int level);
-	Word(int id);
-
-	bool operator==(const Word& word);
-
-	void setLevel(int level) { level = level_; }
-	int getLevel() const { return level_; }
-	void updateLevel(int value) { level_ += value; }
-
-	void setId(int id) { id_ = id; }
-	int getId() const { return id_; }
-
-	void setAuthorId(int author_id) { author_id_ = author_id; }
-	int getAuthorId() const { return author_id_; }
+class ModelContext;
 
-private:
-	// Word id.
-	int id_;
-
-	// Author id the word is assigned to.
-	int author_id_;
-
-	// Each word has assigned a level in the tree.
-	int level_;
+// A word moved from one author to another: the word index, the author
+// and level it had, and the author it is moved to.
+struct AuthorMove {
+	int word;
+	int old_author_id;
+	int old_level;
+	int new_author_id;
 };
 
 class WordUtils {
 public:
+	// Remove (update = -1) the word from its author, or add
+	// (update = 1) it to its author, in the given model.
 	static void UpdateAuthorFromWord(
+			ModelContext* context,
 			int word,
 			int update);
+
+	// Remove the moved words from their old author, whose id is
+	// author_id. The words themselves are not changed.
+	static void RemoveMovesFromAuthor(
+			ModelContext* context,
+			int author_id,
+			const vector<const AuthorMove*>& moves);
+
+	// Add the moved words to their new author, whose id is author_id.
+	// The list of the author must have room for them, see
+	// AuthorWords::reserve, when authors are changed on several threads.
+	static void AddMovesToAuthor(
+			ModelContext* context,
+			int author_id,
+			const vector<const AuthorMove*>& moves);
 };
 
 // AllWords contains all the words in the corpus,
 // each word has unique index in the corpus.
+// A word has an id, the id of the author it is assigned to and the
+// level in the tree it is assigned to; the author id and the level are
+// -1 while unassigned. The three are kept in separate arrays indexed by
+// the word: the levels in one byte and the author ids in the fewest
+// bytes that hold the number of authors, the largest value of the type
+// standing for -1.
 class AllWords {
 public:
-	static AllWords& GetInstance();
-public:
-	AllWords(const AllWords& from) = delete;
-	AllWords& operator=(const AllWords& from) = delete;
+	AllWords();
 
 	int getWordNo() const { return word_no_; }
-	void setWordNo(const int& word_no) { word_no_ = word_no; }
-	void updateWordNo(int update) { word_no_ += update; }
 
-	void addWord(int word_id, int author_id = -1, int level_ = -1) {
-		words_.emplace_back(Word(word_id, author_id, level_));
-		++word_no_;
-	}
+	// Make room for word_no words of at most author_no authors. The new
+	// words have no author and no level, their ids are then set with
+	// setId, possibly from several threads.
+	void resizeWords(int word_no, int author_no);
+
+	// Move word i to index new_index[i], for a permutation new_index of
+	// the words.
+	void permute(const vector<int>& new_index);
 
-	Word* getMutableWord(int i) { return &words_[i]; }
+	int getId(int word) const { return ids_[word]; }
+	void setId(int word, int id) { ids_[word] = id; }
+
+	// The number of words with each word id, for word ids below
+	// vocabulary_no. Counted on the first call, so the ids may only
+	// change before it, or after resizeWords.
+	const vector<long>& getIdCounts(int vocabulary_no);
+
+	int getLevel(int word) const { return FromStored(levels_[word]); }
+	void setLevel(int word, int level) { levels_[word] = level; }
+
+	int getAuthorId(int word) const {
+		switch (author_id_bytes_) {
+			case 1: return FromStored(author_ids8_[word]);
+			case 2: return FromStored(author_ids16_[word]);
+			default: return FromStored(author_ids32_[word]);
+		}
+	}
+	void setAuthorId(int word, int author_id) {
+		switch (author_id_bytes_) {
+			case 1: author_ids8_[word] = author_id; break;
+			case 2: author_ids16_[word] = author_id; break;
+			default: author_ids32_[word] = author_id; break;
+		}
+	}
 
 private:
+	// Return a stored level or author id, mapping the largest value of
+	// its type back to -1.
+	template <typename T>
+	static int FromStored(T value) {
+		return value == static_cast<T>(-1) ? -1 : static_cast<int>(value);
+	}
+
 	// Number of words.
 	int word_no_;
 
-	// All the words.
-	vector<Word> words_;
+	// The word ids and the levels of all the words.
+	vector<int> ids_;
+	vector<uint8_t> levels_;
+
+	// The number of words with each word id, see getIdCounts.
+	vector<long> id_counts_;
 
-	AllWords() {}
+	// The author ids of all the words, in the one of the arrays of
+	// author_id_bytes_ bytes per id.
+	int author_id_bytes_;
+	vector<uint8_t> author_ids8_;
+	vector<uint16_t> author_ids16_;
+	vector<uint32_t> author_ids32_;
 };
 
 // The document containing a number of words and authors.
@@ -119,7 +165,15 @@ public:
 	static void PermuteAuthors(Document* document);
 
 	// Sample author id
-	static void SampleAuthors(Document* document);
+	static void SampleAuthors(ModelContext* context, Document* document);
+
+	// Sample the author of each word of the document like SampleAuthors,
+	// but only append the words whose author changes to moves, leaving
+	// the words and the authors unchanged.
+	static void SampleAuthorMoves(
+			ModelContext* context,
+			Document* document,
+			vector<AuthorMove>* moves);
 
 };
 
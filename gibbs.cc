@@ -1,15 +1,28 @@
 #include <assert.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <thread>
 
 #include "gibbs.h"
+#include "parallel.h"
+#include "server.h"
 
 #define REP_NO 1
 #define DEFAULT_HYPER_LAG 0
 #define DEFAULT_SHUFFLE_LAG 100
 #define DEFAULT_LEVEL_LAG -1
 #define DEFAULT_SAMPLE_GAM 0
+#define DEFAULT_THREADS 1
+#define DEFAULT_PROCESSES 1
+#define DEFAULT_SWAP_LAG 10
+#define DEFAULT_GROUP_LAG 10
+// First random stream id of the initialization chains.
+#define CHAIN_STREAM_BASE (1 << 30)
 #define BUF_SIZE 100
 
 namespace hatm {
@@ -30,20 +43,40 @@ GibbsState::GibbsState()
       level_lag_(DEFAULT_LEVEL_LAG),
       sample_eta_(0),
       sample_gem_(0),
-      sample_gam_(DEFAULT_SAMPLE_GAM) {
+      sample_gam_(DEFAULT_SAMPLE_GAM),
+      threads_(DEFAULT_THREADS),
+      parallel_mode_(PARALLEL_MODE_SERIAL),
+      processes_(DEFAULT_PROCESSES),
+      rep_no_(REP_NO),
+      swap_lag_(DEFAULT_SWAP_LAG),
+      verbose_(true),
+      group_lag_(DEFAULT_GROUP_LAG) {
 }
 
 
+void GibbsState::setCleanup(thread&& cleanup) {
+  cleanup_ = shared_ptr<thread>(new thread(move(cleanup)), [](thread* t) {
+    t->join();
+    delete t;
+  });
+}
+
 double GibbsState::computeGibbsScore() {
   // Compute the GEM, Eta and Gamma scores.
-  gem_score_ = CorpusUtils::GemScore(&corpus_);
+  gem_score_ = CorpusUtils::GemScore(
+      &corpus_, context_.getMutableAllAuthors());
   eta_score_ = TopicUtils::EtaScore((&tree_)->getMutableRootTopic());
   gamma_score_ = TopicUtils::GammaScore((&tree_)->getMutableRootTopic());
   score_ = gem_score_ + eta_score_ + gamma_score_;
-  cout << "Gem_score: " << gem_score_ << endl;
-  cout << "Eta_score: " << eta_score_ << endl;
-  cout << "Gamma_score: " << gamma_score_ << endl;
-  cout << "Score: " << score_ << endl;
+  if (verbose_) {
+    cout << "Gem_score: " << gem_score_ << endl;
+    cout << "Eta_score: " << eta_score_ << endl;
+    cout << "Gamma_score: " << gamma_score_ << endl;
+    cout << "Score: " << score_ << endl;
+    cout << "Topics: " << tree_.getLiveTopics()
+         << " (peak " << tree_.getPeakTopics()
+         << ", reused " << tree_.getReusedTopics() << ")" << endl;
+  }
 
   // Update the maximum score if necessary.
   if (score_ > max_score_ || iteration_ == 0) {
@@ -66,7 +99,13 @@ void GibbsSampler::ReadGibbsInput(
   ifstream infile(filename_settings.c_str());
   char buf[BUF_SIZE];
 
-  int depth, sample_eta, sample_gem;
+  int depth = 0, sample_eta, sample_gem;
+  int threads = DEFAULT_THREADS, parallel_mode = PARALLEL_MODE_SERIAL;
+  int processes = DEFAULT_PROCESSES;
+  int rep_no = REP_NO;
+  vector<double> temperatures;
+  int swap_lag = DEFAULT_SWAP_LAG;
+  int group_lag = DEFAULT_GROUP_LAG;
   vector<double> eta;
   double gem_mean = 0.0, gem_scale = 0.0,
 				 scaling_shape = 0.0, scaling_scale = 0.0;
@@ -97,20 +136,92 @@ void GibbsSampler::ReadGibbsInput(
       sample_eta = atoi(value.c_str());
     } else if (str.compare("SAMPLE_GEM") == 0) {
       sample_gem = atoi(value.c_str());
+    } else if (str.compare("THREADS") == 0) {
+      threads = atoi(value.c_str());
+    } else if (str.compare("TEMPERATURES") == 0) {
+      do {
+        if (!value.empty()) {
+          temperatures.push_back(atof(value.c_str()));
+        }
+      } while (getline(s_line, value, ' '));
+    } else if (str.compare("SWAP_LAG") == 0) {
+      swap_lag = atoi(value.c_str());
+    } else if (str.compare("GROUP_LAG") == 0) {
+      group_lag = atoi(value.c_str());
+    } else if (str.compare("PROCESSES") == 0) {
+      processes = atoi(value.c_str());
+    } else if (str.compare("REP_NO") == 0) {
+      rep_no = atoi(value.c_str());
+    } else if (str.compare("PARALLEL_MODE") == 0) {
+      if (value.compare("adlda") == 0) {
+        parallel_mode = PARALLEL_MODE_ADLDA;
+      } else if (value.compare("sharded") == 0) {
+        parallel_mode = PARALLEL_MODE_SHARDED;
+      } else if (value.compare("vocabulary") == 0) {
+        parallel_mode = PARALLEL_MODE_VOCABULARY;
+      } else if (value.compare("processes") == 0) {
+        parallel_mode = PARALLEL_MODE_PROCESSES;
+      } else {
+        parallel_mode = PARALLEL_MODE_SERIAL;
+      }
     }
   }
 
   infile.close();
 
+  // The levels of the words are stored in a byte, with 255 for a word
+  // without a level, see AllWords.
+  if (depth < 1 || depth > 255) {
+    cerr << "DEPTH must be between 1 and 255." << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // The first temperature is the one of the model, the hotter chains
+  // follow in ascending order.
+  if (!temperatures.empty()) {
+    bool valid = temperatures[0] == 1.0;
+    for (size_t i = 1; i < temperatures.size(); i++) {
+      valid = valid && temperatures[i] > 0.0;
+    }
+    if (!valid) {
+      cerr << "TEMPERATURES must start with 1 and be positive." << endl;
+      exit(EXIT_FAILURE);
+    }
+    sort(temperatures.begin() + 1, temperatures.end());
+  }
+
   // Create corpus.
+  if (threads <= 0) {
+    threads = DEFAULT_THREADS;
+  }
   Corpus corpus(gem_mean, gem_scale);
-  CorpusUtils::ReadCorpus(filename_corpus, filename_authors, &corpus, depth);
+  bool read;
+  if (CorpusUtils::IsBinaryCorpus(filename_corpus)) {
+    read = CorpusUtils::ReadBinaryCorpus(filename_corpus, &corpus,
+                                         gibbs_state->getMutableContext(),
+                                         depth, threads);
+  } else {
+    read = CorpusUtils::ReadCorpus(filename_corpus, filename_authors,
+                                   &corpus,
+                                   gibbs_state->getMutableContext(), depth,
+                                   threads);
+  }
+  if (!read) {
+    exit(EXIT_FAILURE);
+  }
 
   // Create tree of topics.
   Tree tree(depth, corpus.getWordNo(), eta, scaling_shape, scaling_scale);
 
   gibbs_state->setSampleEta(sample_eta);
   gibbs_state->setSampleGem(sample_gem);
+  gibbs_state->setThreads(threads);
+  gibbs_state->setParallelMode(parallel_mode);
+  gibbs_state->setProcesses(processes > 0 ? processes : DEFAULT_PROCESSES);
+  gibbs_state->setRepNo(rep_no > 0 ? rep_no : REP_NO);
+  gibbs_state->setTemperatures(temperatures);
+  gibbs_state->setSwapLag(swap_lag > 0 ? swap_lag : DEFAULT_SWAP_LAG);
+  gibbs_state->setGroupLag(group_lag > 0 ? group_lag : DEFAULT_GROUP_LAG);
   gibbs_state->setCorpus(corpus);
   gibbs_state->setTree(tree);
 }
@@ -120,6 +231,8 @@ void GibbsSampler::InitGibbsState(
 
   Corpus* corpus = gibbs_state->getMutableCorpus();
   Tree* tree = gibbs_state->getMutableTree();
+  ModelContext* context = gibbs_state->getMutableContext();
+  AllWords* all_words = context->getMutableAllWords();
   int depth = tree->getDepth();
 
   // Permute Authors in the corpus.
@@ -127,13 +240,15 @@ void GibbsSampler::InitGibbsState(
 
   for (int i = 0; i < corpus->getDocuments(); i++) {
     Document* document = corpus->getMutableDocument(i);
-    DocumentUtils::SampleAuthors(document);
+    DocumentUtils::SampleAuthors(context, document);
   }
+  TaskScheduler scheduler(gibbs_state->getThreads());
+  CorpusUtils::GroupWordsByAuthor(corpus, context, &scheduler);
 
-  AllAuthors& all_authors = AllAuthors::GetInstance();
+  AllAuthors* all_authors = context->getMutableAllAuthors();
 
-  for (int i = 0; i < all_authors.getAuthors(); i++) {
-    Author* author = all_authors.getMutableAuthor(i);
+  for (int i = 0; i < all_authors->getAuthors(); i++) {
+    Author* author = all_authors->getMutableAuthor(i);
 
     // Initialize the level counts to 0.
     author->initLevelCounts(depth);
@@ -157,7 +272,8 @@ void GibbsSampler::InitGibbsState(
 
     // Sample levels for this author, without permuting the words
     // in the author and without removing words from levels.
-    AuthorUtils::SampleLevels(author,
+    AuthorUtils::SampleLevels(all_words,
+                                author,
                                 0,
                                 false,
                                 corpus->getGemMean(),
@@ -166,11 +282,12 @@ void GibbsSampler::InitGibbsState(
     // Sample the author path starting at level 0 and removing words from
     // levels.
     if (i > 0) {
-      AuthorTreeUtils::SampleAuthorPath(tree, author, true, 0);
+      AuthorTreeUtils::SampleAuthorPath(tree, all_words, author, true, 0);
     }
 
     // Sample levels for this author, and permute the words in the author.
-    AuthorUtils::SampleLevels(author,
+    AuthorUtils::SampleLevels(all_words,
+                                author,
                                 0,
                                 true,
                                 corpus->getGemMean(),
@@ -180,7 +297,9 @@ void GibbsSampler::InitGibbsState(
   // Compute the Gibbs score.
   double gibbs_score = gibbs_state->computeGibbsScore();
 
-  cout << "Gibbs score = " << gibbs_score << endl;
+  if (gibbs_state->isVerbose()) {
+    cout << "Gibbs score = " << gibbs_score << endl;
+  }
 }
 
 GibbsState* GibbsSampler::InitGibbsStateRep(
@@ -188,34 +307,100 @@ GibbsState* GibbsSampler::InitGibbsStateRep(
     const string& filename_authors,
     const std::string& filename_settings,
     long random_seed) {
-  double best_score = 0.0;
-  GibbsState* best_gibbs_state = NULL;
+  // Read the input once.
+  GibbsState input_state;
+  ReadGibbsInput(&input_state, filename_corpus, filename_authors,
+                 filename_settings);
 
-  for (int i = 0; i < REP_NO; i++) {
-    // Initialize the random number generator.
-    Utils::InitRandomNumberGen(random_seed);
+  return InitGibbsStateRep(input_state, random_seed);
+}
 
-    GibbsState* gibbs_state = new GibbsState();
-    ReadGibbsInput(gibbs_state, filename_corpus, filename_authors, filename_settings);
+GibbsState* GibbsSampler::InitGibbsStateRep(
+    const GibbsState& input_state,
+    long random_seed) {
+  // Initialize the random number generator.
+  Utils::InitRandomNumberGen(random_seed);
+
+  // Fork the worker processes while the process has a single thread.
+  shared_ptr<ParameterServer> server;
+  if (input_state.getParallelMode() == PARALLEL_MODE_PROCESSES &&
+      input_state.getProcesses() > 1) {
+    server = make_shared<ParameterServer>(
+        input_state, input_state.getProcesses());
+  }
 
-    // Initialize the Gibbs state.
-    InitGibbsState(gibbs_state);
+  int rep_no = input_state.getRepNo();
+  vector<GibbsState*> gibbs_states;
+  InitGibbsStates(input_state, rep_no, &gibbs_states);
 
-    // Update Gibbs best state if necessary.
-    if (gibbs_state->getScore()  > best_score || i == 0) {
-      if (best_gibbs_state != NULL) {
-        delete best_gibbs_state;
-      }
-      best_gibbs_state = gibbs_state;
-      best_score = gibbs_state->getScore();
-      cout << "Best initial state at iteration: " <<
-          i << " score " << best_score << endl;
-    } else {
-      delete gibbs_state;
+  // Keep the Gibbs state with the best score.
+  int best = 0;
+  for (int i = 1; i < rep_no; i++) {
+    if (gibbs_states[i]->getScore() > gibbs_states[best]->getScore()) {
+      best = i;
     }
   }
+  cout << "Best initial state at iteration: " <<
+      best << " score " << gibbs_states[best]->getScore() << endl;
 
-  return best_gibbs_state;
+  gibbs_states[best]->setParameterServer(server);
+
+  // Delete the other states without holding up the sampler.
+  vector<GibbsState*> losers;
+  for (int i = 0; i < rep_no; i++) {
+    if (i != best) {
+      losers.push_back(gibbs_states[i]);
+    }
+  }
+  if (!losers.empty()) {
+    gibbs_states[best]->setCleanup(thread([losers]() {
+      for (size_t i = 0; i < losers.size(); i++) {
+        delete losers[i];
+      }
+    }));
+  }
+
+  return gibbs_states[best];
+}
+
+void GibbsSampler::InitGibbsStates(
+    const GibbsState& input_state,
+    int chains,
+    vector<GibbsState*>* gibbs_states) {
+  gibbs_states->assign(chains, NULL);
+  if (chains == 1) {
+    (*gibbs_states)[0] = new GibbsState(input_state);
+    InitGibbsState((*gibbs_states)[0]);
+    return;
+  }
+
+  // Each chain copies the input, which is only read, and initializes
+  // its copy on its own thread and random stream.
+  vector<thread> threads;
+  for (int i = 0; i < chains; i++) {
+    threads.push_back(thread([&input_state, gibbs_states, i]() {
+      RandomStream stream = Utils::MakeStream(CHAIN_STREAM_BASE + i);
+      Utils::SetStream(&stream);
+      (*gibbs_states)[i] = new GibbsState(input_state);
+      (*gibbs_states)[i]->setVerbose(false);
+      InitGibbsState((*gibbs_states)[i]);
+      Utils::SetStream(NULL);
+    }));
+  }
+  for (int i = 0; i < chains; i++) {
+    threads[i].join();
+  }
+
+  // The chains run quiet so their output does not interleave; report
+  // them here, in order.
+  for (int i = 0; i < chains; i++) {
+    GibbsState* gibbs_state = (*gibbs_states)[i];
+    gibbs_state->setVerbose(input_state.isVerbose());
+    if (gibbs_state->isVerbose()) {
+      cout << "Chain " << i << ": score " << gibbs_state->getScore()
+           << " topics " << gibbs_state->getTree().getLiveTopics() << endl;
+    }
+  }
 }
 
 void GibbsSampler::IterateGibbsState(GibbsState* gibbs_state) {
@@ -223,10 +408,15 @@ void GibbsSampler::IterateGibbsState(GibbsState* gibbs_state) {
 
   Tree* tree = gibbs_state->getMutableTree();
   Corpus* corpus = gibbs_state->getMutableCorpus();
+  ModelContext* context = gibbs_state->getMutableContext();
+  AllWords* all_words = context->getMutableAllWords();
   gibbs_state->incIteration(1);
   int current_iteration = gibbs_state->getIteration();
 
-  cout << "Start iteration..." << gibbs_state->getIteration() << endl;
+  bool verbose = gibbs_state->isVerbose();
+  if (verbose) {
+    cout << "Start iteration..." << gibbs_state->getIteration() << endl;
+  }
 
   int level_lag = gibbs_state->getLevelLag();
 
@@ -251,26 +441,79 @@ void GibbsSampler::IterateGibbsState(GibbsState* gibbs_state) {
     CorpusUtils::PermuteDocuments(corpus);
   }
 
-  for (int i = 0; i < corpus->getDocuments(); i++) {
-    Document* document = corpus->getMutableDocument(i);
-    DocumentUtils::SampleAuthors(document);
+  int parallel_mode = gibbs_state->getParallelMode();
+  ParameterServer* server = gibbs_state->getMutableParameterServer();
+  if (parallel_mode == PARALLEL_MODE_PROCESSES ?
+      server == NULL : gibbs_state->getThreads() <= 1) {
+    parallel_mode = PARALLEL_MODE_SERIAL;
+  }
+  TaskScheduler scheduler(gibbs_state->getThreads());
+
+  // Sample the author of each word.
+  if (parallel_mode != PARALLEL_MODE_SERIAL &&
+      gibbs_state->getThreads() > 1) {
+    ParallelSampler::SampleDocumentAuthors(
+        tree, context, corpus, &scheduler, current_iteration);
+  } else {
+    for (int i = 0; i < corpus->getDocuments(); i++) {
+      Document* document = corpus->getMutableDocument(i);
+      DocumentUtils::SampleAuthors(context, document);
+    }
+  }
+
+  // Lay the words of each author out contiguously again. The authors
+  // of the words only change by a few words per sweep, so the layout is
+  // renewed every group lag sweeps rather than on every sweep.
+  if (current_iteration % gibbs_state->getGroupLag() == 0) {
+    CorpusUtils::GroupWordsByAuthor(corpus, context, &scheduler);
   }
 
-  AllAuthors& all_authors = AllAuthors::GetInstance();
+  AllAuthors* all_authors = context->getMutableAllAuthors();
 
   // Sample author path and word levels.
-  for (int i = 0; i < all_authors.getAuthors(); i++) {
-    Author* author = all_authors.getMutableAuthor(i);
-    AuthorTreeUtils::SampleAuthorPath(
-        tree, author, true, sampling_level);
-  }
-  for (int i = 0; i < all_authors.getAuthors(); i++) {
-    Author* author = all_authors.getMutableAuthor(i);
-    AuthorUtils::SampleLevels(author,
-                              permute,
-                              true,
-                              corpus->getGemMean(),
-                              corpus->getGemScale());
+  if (parallel_mode == PARALLEL_MODE_ADLDA) {
+    ParallelSampler::SampleAuthorsAdLda(
+        tree, context, corpus, &scheduler,
+        current_iteration, sampling_level, permute);
+  } else if (parallel_mode == PARALLEL_MODE_PROCESSES) {
+    server->sampleAuthors(
+        tree, context, corpus, current_iteration, sampling_level, permute);
+  } else {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int i = 0; i < all_authors->getAuthors(); i++) {
+      Author* author = all_authors->getMutableAuthor(i);
+      AuthorTreeUtils::SampleAuthorPath(
+          tree, all_words, author, true, sampling_level);
+    }
+    if (parallel_mode == PARALLEL_MODE_SHARDED) {
+      ParallelSampler::SampleLevelsSharded(
+          tree, context, corpus, &scheduler, current_iteration, permute);
+    } else if (parallel_mode == PARALLEL_MODE_VOCABULARY) {
+      ParallelSampler::SampleLevelsByVocabulary(
+          tree, context, corpus, &scheduler, current_iteration, permute);
+    } else {
+      for (int i = 0; i < all_authors->getAuthors(); i++) {
+        Author* author = all_authors->getMutableAuthor(i);
+        AuthorUtils::SampleLevels(all_words,
+                                  author,
+                                  permute,
+                                  true,
+                                  corpus->getGemMean(),
+                                  corpus->getGemScale());
+      }
+
+      // The same fields as the AD-LDA sweep, so the logs of the two
+      // modes compare directly.
+      double seconds = chrono::duration<double>(
+          chrono::steady_clock::now() - start).count();
+      if (verbose) {
+        cout << "Serial sweep: threads 1"
+             << " sample " << seconds << "s"
+             << " merge 0s"
+             << " wall " << seconds << "s"
+             << " busy " << seconds << "s" << endl;
+      }
+    }
   }
 
   // Sample hyper-parameters.
@@ -280,17 +523,29 @@ void GibbsSampler::IterateGibbsState(GibbsState* gibbs_state) {
       TreeUtils::UpdateEta(tree);
     }
     if (gibbs_state->getSampleGem() == 1) {
-      CorpusUtils::UpdateGemScale(corpus);
-      CorpusUtils::UpdateGemMean(corpus);
+      int scale_changes = CorpusUtils::UpdateGemScale(corpus, all_authors);
+      int mean_changes = CorpusUtils::UpdateGemMean(corpus, all_authors);
+      if (verbose) {
+        cout << "Gem scale: (1) score_change: " << scale_changes <<
+            " (2) new_gem_scale: " << corpus->getGemScale() << endl;
+        cout << "Gem mean: (1) score_change: " << mean_changes <<
+            " (2) new_gem_mean: " << corpus->getGemMean() << endl;
+      }
     }
     // No gamma sampling.
   }
 
+  // Wait for the cleanup of the initialization, which overlapped the
+  // first sweep.
+  gibbs_state->joinCleanup();
+
   // Compute the Gibbs score with the new parameter values.
   double gibbs_score = gibbs_state->computeGibbsScore();
 
-  cout << "Gibbs score at iteration "
-       << gibbs_state->getIteration() << " = " << gibbs_score << endl;
+  if (verbose) {
+    cout << "Gibbs score at iteration "
+         << gibbs_state->getIteration() << " = " << gibbs_score << endl;
+  }
 }
 
 }  // namespace hlda
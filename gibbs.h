@@ -1,20 +1,43 @@
 #ifndef GIBBS_H_
 #define GIBBS_H_
 
+#include <memory>
 #include <string>
+#include <thread>
 
 #include "topic.h"
 #include "tree.h"
 #include "utils.h"
 #include "corpus.h"
+#include "context.h"
+
+// Ways of sampling the author paths and word levels.
+// Serial: one author at a time on the calling thread.
+// AD-LDA: authors partitioned across threads sampling against copies
+// of the tree, merged at the end of each sweep (see ParallelSampler).
+// Sharded: paths sampled serially, then levels sampled on threads
+// sharing the tree with per-thread word count shards.
+// Vocabulary: paths sampled serially, then levels sampled on threads
+// owning rotating ranges of the vocabulary.
+// Processes: authors partitioned across worker processes served by a
+// parameter server (see ParameterServer).
+#define PARALLEL_MODE_SERIAL 0
+#define PARALLEL_MODE_ADLDA 1
+#define PARALLEL_MODE_SHARDED 2
+#define PARALLEL_MODE_VOCABULARY 3
+#define PARALLEL_MODE_PROCESSES 4
 
 namespace hatm {
 
+class ParameterServer;
+
 
 // The Gibbs state of the HLDA implementation.
-// Each Gibbs state has a corpus and a tree, and
-// keeps current scores, the current iteration and
-// the sampling parameters.
+// Each Gibbs state has a corpus, a tree and a model context holding
+// the words and authors, and keeps current scores, the current
+// iteration and the sampling parameters.
+// A state may be copied before it is initialized, once author paths
+// point into its tree it may not.
 class GibbsState {
  public:
   GibbsState();
@@ -45,11 +68,15 @@ class GibbsState {
   void setSampleGem(int sample_gem) { sample_gem_ = sample_gem; }
 
   void setCorpus(const Corpus& corpus) { corpus_ = corpus; }
+  const Corpus& getCorpus() const { return corpus_; }
   Corpus* getMutableCorpus() { return &corpus_; }
 
   void setTree(const Tree& tree) { tree_ = tree; }
+  const Tree& getTree() const { return tree_; }
   Tree* getMutableTree() { return &tree_; }
 
+  ModelContext* getMutableContext() { return &context_; }
+
   int getIteration() const { return iteration_; }
   void setIteration(int iteration) { iteration_ = iteration; }
   void incIteration(int val) { iteration_ += val; }
@@ -61,9 +88,55 @@ class GibbsState {
   int getSampleGem() const { return sample_gem_; }
   int getSampleGam() const { return sample_gam_; }
 
+  void setThreads(int threads) { threads_ = threads; }
+  int getThreads() const { return threads_; }
+
+  void setParallelMode(int parallel_mode) { parallel_mode_ = parallel_mode; }
+  int getParallelMode() const { return parallel_mode_; }
+
+  void setProcesses(int processes) { processes_ = processes; }
+  int getProcesses() const { return processes_; }
+
+  // The server of the worker processes, shared by the copies of the
+  // state, or NULL.
+  void setParameterServer(const shared_ptr<ParameterServer>& server) {
+    parameter_server_ = server;
+  }
+  ParameterServer* getMutableParameterServer() {
+    return parameter_server_.get();
+  }
+
+  void setRepNo(int rep_no) { rep_no_ = rep_no; }
+  int getRepNo() const { return rep_no_; }
+
+  void setTemperatures(const vector<double>& temperatures) {
+    temperatures_ = temperatures;
+  }
+  const vector<double>& getTemperatures() const { return temperatures_; }
+
+  void setSwapLag(int swap_lag) { swap_lag_ = swap_lag; }
+  int getSwapLag() const { return swap_lag_; }
+
+  // Whether the sweeps of the state print their scores. The chains of
+  // a TemperingSampler are quiet, and reported by the sampler.
+  void setVerbose(bool verbose) { verbose_ = verbose; }
+  bool isVerbose() const { return verbose_; }
+
+  // Number of sweeps between the layouts of the words by author, see
+  // CorpusUtils::GroupWordsByAuthor.
+  void setGroupLag(int group_lag) { group_lag_ = group_lag; }
+  int getGroupLag() const { return group_lag_; }
+
+  // A thread doing cleanup work for the state, such as deleting the
+  // chains InitGibbsStateRep did not keep. It is joined by
+  // joinCleanup, or when the state is destroyed.
+  void setCleanup(thread&& cleanup);
+  void joinCleanup() { cleanup_.reset(); }
+
  private:
   Corpus corpus_;
   Tree tree_;
+  ModelContext context_;
 
   // The current score obtained by summing the Eta, Gamma and
   // GEM scores.
@@ -92,6 +165,28 @@ class GibbsState {
   int sample_eta_;
   int sample_gem_;
   int sample_gam_;
+
+  // Parallel sampling parameters.
+  int threads_;
+  int parallel_mode_;
+  int processes_;
+  shared_ptr<ParameterServer> parameter_server_;
+
+  // Number of chains initialized by InitGibbsStateRep.
+  int rep_no_;
+
+  // Parallel tempering parameters, see TemperingSampler.
+  vector<double> temperatures_;
+  int swap_lag_;
+
+  bool verbose_;
+
+  // Number of sweeps between the layouts of the words by author.
+  int group_lag_;
+
+  // The cleanup thread, joined when the last copy of the pointer is
+  // released.
+  shared_ptr<thread> cleanup_;
 };
 
 // This class provides functionality for reading input for the
@@ -100,6 +195,8 @@ class GibbsState {
 class GibbsSampler {
  public:
   // Read input corpus and state parameters from file.
+  // A corpus file in the binary format of hatm_convert is read directly,
+  // the authors file is then not used.
   static void ReadGibbsInput(
       GibbsState* gibbs_state,
       const std::string& filename_corpus,
@@ -110,9 +207,15 @@ class GibbsSampler {
   static void InitGibbsState(
       GibbsState* gibbs_state);
 
-  // Initialize Gibbs state - repeat the initialization REP_NO,
-  // by calling InitGibbsState.
-  // Keep the Gibbs state with the best score.
+  // Initialize Gibbs state - repeat the initialization REP_NO times
+  // (or as set in the settings file), by calling InitGibbsState.
+  // The input is read once. The repetitions run as concurrent chains,
+  // each on its own thread and random stream, starting from a copy of
+  // the input. Each chain samples its own word and author assignments,
+  // so it copies the corpus and the words: memory grows with the
+  // number of chains. Keep the Gibbs state with the best score; the
+  // others are deleted on a cleanup thread of the kept state, which
+  // the first iteration joins.
   // rng_seed is the random number generator seed.
   static GibbsState* InitGibbsStateRep(
       const std::string& filename_corpus,
@@ -120,6 +223,20 @@ class GibbsSampler {
       const std::string& filename_settings,
       long rng_seed);
 
+  // Initialize Gibbs state as above, from input already read by
+  // ReadGibbsInput.
+  static GibbsState* InitGibbsStateRep(
+      const GibbsState& input_state,
+      long rng_seed);
+
+  // Initialize chains Gibbs states, each a copy of the input state.
+  // More than one chain are initialized concurrently, each on its own
+  // thread and random stream. The caller owns the states.
+  static void InitGibbsStates(
+      const GibbsState& input_state,
+      int chains,
+      vector<GibbsState*>* gibbs_states);
+
   // Iterations of the Gibbs state.
   // Sample the document path and the word levels in the tree.
   // Sample hyperparameters: Eta, GEM mean and scale.
@@ -1,6 +1,7 @@
 #include <iostream>
 
 #include "gibbs.h"
+#include "tempering.h"
 
 using hatm::GibbsSampler;
 using hatm::GibbsState;
@@ -19,18 +20,30 @@ int main(int argc, char** argv) {
     string filename_corpus = argv[1];
     string filename_authors = argv[2];
     string filename_settings = argv[3];
-    hatm::GibbsState* gibbs_state = hatm::GibbsSampler::InitGibbsStateRep(
-        filename_corpus, filename_authors, filename_settings, rng_seed);
-
-    for (int i = 0; i < MAX_ITERATIONS; i++) {
-      hatm::GibbsSampler::IterateGibbsState(gibbs_state);
+    hatm::GibbsState input_state;
+    hatm::GibbsSampler::ReadGibbsInput(
+        &input_state, filename_corpus, filename_authors, filename_settings);
+
+    if (input_state.getTemperatures().size() > 1) {
+      // Parallel tempering, one chain per temperature.
+      hatm::TemperingSampler sampler(input_state, rng_seed);
+      for (int i = 0; i < MAX_ITERATIONS; i++) {
+        sampler.iterate();
+      }
+    } else {
+      hatm::GibbsState* gibbs_state = hatm::GibbsSampler::InitGibbsStateRep(
+          input_state, rng_seed);
+
+      for (int i = 0; i < MAX_ITERATIONS; i++) {
+        hatm::GibbsSampler::IterateGibbsState(gibbs_state);
+      }
+
+      delete gibbs_state;
     }
-
-    delete gibbs_state;
   } else {
     cout << "Arguments: "
         "(1) corpus filename "
-        "(2) authors filename "
+        "(2) authors filename, unused for a binary corpus "
         "(3) settings filename" << endl;
   }
   return 0;
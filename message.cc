@@ -0,0 +1,73 @@
+#include <assert.h>
+#include <string.h>
+
+#include "message.h"
+
+namespace hatm {
+
+// =======================================================================
+// MessageWriter
+// =======================================================================
+
+void MessageWriter::putInts(const vector<int>& values) {
+  putInt(values.size());
+  if (!values.empty()) {
+    put(values.data(), values.size() * sizeof(int));
+  }
+}
+
+void MessageWriter::putDoubles(const vector<double>& values) {
+  putInt(values.size());
+  if (!values.empty()) {
+    put(values.data(), values.size() * sizeof(double));
+  }
+}
+
+// =======================================================================
+// MessageReader
+// =======================================================================
+
+MessageReader::MessageReader(const string& message)
+    : message_(message),
+      position_(0) {
+}
+
+int MessageReader::getInt() {
+  int value;
+  get(&value, sizeof(value));
+  return value;
+}
+
+int64_t MessageReader::getLong() {
+  int64_t value;
+  get(&value, sizeof(value));
+  return value;
+}
+
+double MessageReader::getDouble() {
+  double value;
+  get(&value, sizeof(value));
+  return value;
+}
+
+void MessageReader::getInts(vector<int>* values) {
+  values->resize(getInt());
+  if (!values->empty()) {
+    get(values->data(), values->size() * sizeof(int));
+  }
+}
+
+void MessageReader::getDoubles(vector<double>* values) {
+  values->resize(getInt());
+  if (!values->empty()) {
+    get(values->data(), values->size() * sizeof(double));
+  }
+}
+
+void MessageReader::get(void* data, size_t size) {
+  assert(position_ + size <= message_.size());
+  memcpy(data, message_.data() + position_, size);
+  position_ += size;
+}
+
+}  // namespace hatm
@@ -0,0 +1,65 @@
+#ifndef MESSAGE_H_
+#define MESSAGE_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace hatm {
+
+// Builds a binary message from integers and doubles, in the byte order
+// of the host. Messages are only exchanged between processes on one
+// host, see Transport.
+class MessageWriter {
+ public:
+  MessageWriter() {}
+
+  void putInt(int value) { put(&value, sizeof(value)); }
+  void putLong(int64_t value) { put(&value, sizeof(value)); }
+  void putDouble(double value) { put(&value, sizeof(value)); }
+
+  // Put the size of the vector followed by its values.
+  void putInts(const vector<int>& values);
+  void putDoubles(const vector<double>& values);
+
+  const string& getMessage() const { return message_; }
+  string* getMutableMessage() { return &message_; }
+
+ private:
+  void put(const void* data, size_t size) {
+    message_.append(static_cast<const char*>(data), size);
+  }
+
+  string message_;
+};
+
+// Reads the values of a message in the order they were put by a
+// MessageWriter. The message must outlive the reader.
+class MessageReader {
+ public:
+  explicit MessageReader(const string& message);
+
+  int getInt();
+  int64_t getLong();
+  double getDouble();
+  void getInts(vector<int>* values);
+  void getDoubles(vector<double>* values);
+
+  // Whether all values were read.
+  bool isDone() const { return position_ == message_.size(); }
+
+ private:
+  void get(void* data, size_t size);
+
+  const string& message_;
+
+  // Offset of the next value.
+  size_t position_;
+};
+
+}  // namespace hatm
+
+#endif  // MESSAGE_H_
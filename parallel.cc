@@ -0,0 +1,656 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <set>
+#include <thread>
+#include <unordered_map>
+
+#include "parallel.h"
+#include "topic.h"
+
+// The parallel phases of an iteration, see ParallelSampler::StreamId.
+#define PHASE_DOCUMENT_AUTHORS 0
+#define PHASE_AUTHORS 1
+#define PHASE_LEVELS 2
+#define PHASE_VOCABULARY 3
+#define PHASE_LEVEL_CHUNKS 4
+#define PHASES 5
+// First random stream id of the parallel phases, past the streams of
+// the chains, the tempering and the worker processes.
+#define PARALLEL_STREAM_BASE (1L << 32)
+
+// Authors with more words than this are sampled in chunks of this many
+// words by SampleLevelsSharded.
+#define LEVEL_CHUNK_WORDS 4096
+
+namespace hatm {
+
+// A task of SampleLevelsSharded: the words [begin, end) of an author.
+// large is -1 for a whole author; otherwise the words are those of the
+// large-th large author, sampled against the chunk-th copy of the
+// author.
+struct LevelTask {
+  LevelTask(int author, int large, int begin, int end)
+      : author(author), large(large), chunk(-1), begin(begin), end(end) {}
+
+  int author;
+  int large;
+  int chunk;
+  int begin;
+  int end;
+};
+
+// Wall clock time in seconds.
+static double Now() {
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// =======================================================================
+// TaskScheduler
+// =======================================================================
+
+TaskScheduler::TaskScheduler(int threads)
+    : threads_(threads),
+      queues_(threads),
+      mutexes_(threads),
+      steals_(threads, 0),
+      busy_time_(threads, 0.0),
+      run_time_(0.0) {
+}
+
+void TaskScheduler::run(
+    int tasks,
+    const function<void(int task, int worker)>& task) {
+  double start_time = Now();
+  for (int w = 0; w < threads_; w++) {
+    queues_[w].clear();
+    steals_[w] = 0;
+    busy_time_[w] = 0.0;
+  }
+  for (int i = 0; i < tasks; i++) {
+    queues_[i % threads_].push_back(i);
+  }
+
+  // The calling thread is worker 0.
+  vector<thread> workers;
+  for (int w = 1; w < threads_; w++) {
+    workers.push_back(thread(&TaskScheduler::work, this, w, cref(task)));
+  }
+  work(0, task);
+  for (size_t i = 0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+  run_time_ = Now() - start_time;
+}
+
+void TaskScheduler::work(
+    int worker,
+    const function<void(int task, int worker)>& task) {
+  for (int i = next(worker); i != -1; i = next(worker)) {
+    double start_time = Now();
+    task(i, worker);
+    busy_time_[worker] += Now() - start_time;
+  }
+}
+
+int TaskScheduler::next(int worker) {
+  {
+    lock_guard<mutex> lock(mutexes_[worker]);
+    if (!queues_[worker].empty()) {
+      int task = queues_[worker].front();
+      queues_[worker].pop_front();
+      return task;
+    }
+  }
+
+  // Tasks are never added during a run, so once every queue was seen
+  // empty there is no work left.
+  for (int i = 1; i < threads_; i++) {
+    int victim = (worker + i) % threads_;
+    lock_guard<mutex> lock(mutexes_[victim]);
+    if (!queues_[victim].empty()) {
+      int task = queues_[victim].back();
+      queues_[victim].pop_back();
+      steals_[worker]++;
+      return task;
+    }
+  }
+  return -1;
+}
+
+double TaskScheduler::getUtilization(int worker) const {
+  return run_time_ > 0.0 ? busy_time_[worker] / run_time_ : 0.0;
+}
+
+void TaskScheduler::printStatistics() const {
+  cout << "Scheduler: " << run_time_ << "s, steals";
+  for (int w = 0; w < threads_; w++) {
+    cout << " " << steals_[w];
+  }
+  cout << ", utilization";
+  for (int w = 0; w < threads_; w++) {
+    cout << " " << getUtilization(w);
+  }
+  cout << endl;
+}
+
+// =======================================================================
+// ParallelSampler
+// =======================================================================
+
+void ParallelSampler::SampleDocumentAuthors(
+    Tree* tree,
+    ModelContext* context,
+    Corpus* corpus,
+    TaskScheduler* scheduler,
+    int iteration) {
+  AllAuthors* all_authors = context->getMutableAllAuthors();
+  int threads = scheduler->getThreads();
+  double start_time = Now();
+
+  // Each document draws from its own stream and records its own moves.
+  int documents = corpus->getDocuments();
+  vector<vector<AuthorMove> > moves(documents);
+  RandomStream* main_stream = Utils::GetStream();
+  scheduler->run(documents, [&](int task, int /*worker*/) {
+    RandomStream stream = Utils::MakeStream(
+        StreamId(iteration, PHASE_DOCUMENT_AUTHORS, task));
+    Utils::SetStream(&stream);
+    DocumentUtils::SampleAuthorMoves(
+        context, corpus->getMutableDocument(task), &moves[task]);
+  });
+  Utils::SetStream(main_stream);
+  double sample_time = Now();
+
+  // Group the moves by the author they leave and the author they join,
+  // in document order.
+  int authors = all_authors->getAuthors();
+  vector<vector<const AuthorMove*> > removed(authors);
+  vector<vector<const AuthorMove*> > added(authors);
+  long move_no = 0;
+  for (int d = 0; d < documents; d++) {
+    int size = moves[d].size();
+    for (int i = 0; i < size; i++) {
+      const AuthorMove* move = &moves[d][i];
+      if (move->old_author_id != -1) {
+        removed[move->old_author_id].push_back(move);
+      }
+      added[move->new_author_id].push_back(move);
+    }
+    move_no += size;
+  }
+
+  // Each author is changed by one task. A moved word is only changed
+  // by the task of its new author, the task of the old author uses the
+  // level recorded in the move. All words are removed before any is
+  // added, as a moved word keeps its position in the list of its old
+  // author until then, and the lists are given room for the added words
+  // up front, so no list is moved while the tasks run. The tasks only
+  // write to the shards, never read from them, so the counts applied to
+  // the tree do not depend on which worker ran which author.
+  AuthorWords* author_words = all_authors->getMutableAuthorWords();
+  for (int i = 0; i < authors; i++) {
+    author_words->reserve(i, added[i].size());
+  }
+  vector<TopicShard> shards(threads, TopicShard(tree));
+  scheduler->run(authors, [&](int task, int worker) {
+    Tree::SetShard(&shards[worker]);
+    WordUtils::RemoveMovesFromAuthor(context, task, removed[task]);
+  });
+  scheduler->run(authors, [&](int task, int worker) {
+    Tree::SetShard(&shards[worker]);
+    WordUtils::AddMovesToAuthor(context, task, added[task]);
+  });
+  Tree::SetShard(NULL);
+  for (int w = 0; w < threads; w++) {
+    shards[w].apply(tree);
+  }
+
+  double end_time = Now();
+  cout << "Parallel authors: threads " << threads
+       << " moves " << move_no
+       << " sample " << sample_time - start_time << "s"
+       << " apply " << end_time - sample_time << "s" << endl;
+}
+
+void ParallelSampler::SampleAuthorsAdLda(
+    Tree* tree,
+    ModelContext* context,
+    Corpus* corpus,
+    TaskScheduler* scheduler,
+    int iteration,
+    int sampling_level,
+    int permute) {
+  AllWords* all_words = context->getMutableAllWords();
+  AllAuthors* all_authors = context->getMutableAllAuthors();
+  int threads = scheduler->getThreads();
+  double start_time = Now();
+
+  // Each worker samples against its own copy of the tree. An author
+  // records its changes to the copy into its own delta, and the copy is
+  // then reverted, so every author samples against the tree as it was
+  // at the start of the sweep plus its own changes only, whichever
+  // worker runs it.
+  int authors = all_authors->getAuthors();
+  int base_id = tree->getNextId();
+  int depth = tree->getDepth();
+  unordered_map<int, int> base_slots;
+  tree->getTopicSlots(&base_slots);
+  vector<Tree*> worker_trees;
+  for (int w = 0; w < threads; w++) {
+    worker_trees.push_back(new Tree(*tree));
+  }
+  vector<TreeDelta*> deltas(authors, NULL);
+  vector<vector<int> > path_ids(authors, vector<int>(depth));
+
+  // Submit the authors with the most words first, so a large author
+  // does not start last.
+  vector<int> sorted_ids;
+  SortAuthorsBySize(all_authors, &sorted_ids);
+
+  RandomStream* main_stream = Utils::GetStream();
+  scheduler->run(authors, [&](int task, int worker) {
+    Tree* worker_tree = worker_trees[worker];
+    Author* author = all_authors->getMutableAuthor(sorted_ids[task]);
+    int id = author->getId();
+    RandomStream stream = Utils::MakeStream(
+        StreamId(iteration, PHASE_AUTHORS, id));
+    Utils::SetStream(&stream);
+    deltas[id] = new TreeDelta(base_id);
+    worker_tree->setDelta(deltas[id]);
+
+    // Sample author path and word levels.
+    MovePathToTree(worker_tree, author);
+    AuthorTreeUtils::SampleAuthorPath(
+        worker_tree, all_words, author, true, sampling_level);
+    AuthorUtils::SampleLevels(all_words,
+                              author,
+                              permute,
+                              true,
+                              corpus->getGemMean(),
+                              corpus->getGemScale());
+
+    for (int level = 0; level < depth; level++) {
+      path_ids[id][level] = author->getMutablePathTopic(level)->getId();
+    }
+    worker_tree->revert(*tree, *deltas[id], base_slots);
+  });
+  Utils::SetStream(main_stream);
+  double sample_time = Now();
+
+  // Apply the changes of the authors in author order, and move the
+  // author paths to the tree.
+  unordered_map<int, int> slots(base_slots);
+  for (int a = 0; a < authors; a++) {
+    deltas[a]->apply(tree, &slots);
+    Author* author = all_authors->getMutableAuthor(a);
+    for (int level = 0; level < depth; level++) {
+      author->setPathTopic(level,
+                           tree->getMutableTopic(slots.at(path_ids[a][level])));
+    }
+    deltas[a]->forgetNewTopics(&slots);
+    delete deltas[a];
+  }
+  for (int w = 0; w < threads; w++) {
+    delete worker_trees[w];
+  }
+  PruneEmptyTopics(tree);
+
+  double end_time = Now();
+  double busy_time = 0.0;
+  for (int w = 0; w < threads; w++) {
+    busy_time += scheduler->getUtilization(w) * scheduler->getRunTime();
+  }
+  cout << "Parallel sweep: threads " << threads
+       << " sample " << sample_time - start_time << "s"
+       << " merge " << end_time - sample_time << "s"
+       << " wall " << end_time - start_time << "s"
+       << " busy " << busy_time << "s" << endl;
+  scheduler->printStatistics();
+}
+
+void ParallelSampler::SampleLevelsSharded(
+    Tree* tree,
+    ModelContext* context,
+    Corpus* corpus,
+    TaskScheduler* scheduler,
+    int iteration,
+    int permute) {
+  AllWords* all_words = context->getMutableAllWords();
+  AllAuthors* all_authors = context->getMutableAllAuthors();
+  int threads = scheduler->getThreads();
+  double start_time = Now();
+
+  // The tasks: the authors with at most LEVEL_CHUNK_WORDS words, whole,
+  // and the words of larger authors in chunks of that many words. The
+  // words of a large author are permuted once and copied, and each of
+  // its chunks samples against its own copy of the level counts of the
+  // author, which are summed up at the end of the phase.
+  int authors = all_authors->getAuthors();
+  int depth = tree->getDepth();
+  vector<int> large_ids;
+  vector<LevelTask> tasks;
+  for (int i = 0; i < authors; i++) {
+    int words = all_authors->getMutableAuthor(i)->getWords();
+    if (words <= LEVEL_CHUNK_WORDS) {
+      tasks.push_back(LevelTask(i, -1, 0, words));
+      continue;
+    }
+    for (int begin = 0; begin < words; begin += LEVEL_CHUNK_WORDS) {
+      tasks.push_back(LevelTask(i, large_ids.size(), begin,
+                                min(begin + LEVEL_CHUNK_WORDS, words)));
+    }
+    large_ids.push_back(i);
+  }
+  int task_no = tasks.size();
+
+  RandomStream* main_stream = Utils::GetStream();
+  vector<vector<int> > large_words(large_ids.size());
+  scheduler->run(large_ids.size(), [&](int task, int /*worker*/) {
+    Author* author = all_authors->getMutableAuthor(large_ids[task]);
+    RandomStream stream = Utils::MakeStream(
+        StreamId(iteration, PHASE_LEVELS, author->getId()));
+    Utils::SetStream(&stream);
+    if (permute == 1) {
+      AuthorUtils::PermuteWords(author);
+    }
+    int size = author->getWords();
+    large_words[task].resize(size);
+    for (int i = 0; i < size; i++) {
+      large_words[task][i] = author->getWord(i);
+    }
+  });
+  vector<vector<int> > large_counts(large_ids.size(), vector<int>(depth));
+  for (size_t i = 0; i < large_ids.size(); i++) {
+    for (int level = 0; level < depth; level++) {
+      large_counts[i][level] =
+          all_authors->getMutableAuthor(large_ids[i])->getLevelCounts(level);
+    }
+  }
+  vector<Author> chunk_authors;
+  for (int t = 0; t < task_no; t++) {
+    if (tasks[t].large == -1) continue;
+    Author* author = all_authors->getMutableAuthor(tasks[t].author);
+    tasks[t].chunk = chunk_authors.size();
+    chunk_authors.push_back(Author(author->getId(), depth));
+    for (int level = 0; level < depth; level++) {
+      chunk_authors.back().setPathTopic(
+          level, author->getMutablePathTopic(level));
+      chunk_authors.back().updateLevelCounts(
+          level, author->getLevelCounts(level));
+    }
+  }
+
+  // Each task reads the counts of the tree plus its own updates, kept in
+  // the task shard of its worker, and then moves them to the shard of
+  // the worker. The counts of the worker shards are sums, so the tree
+  // gets the same counts whichever worker ran which task.
+  vector<TopicShard> task_shards(threads, TopicShard(tree));
+  vector<TopicShard> shards(threads, TopicShard(tree));
+  scheduler->run(task_no, [&](int task, int worker) {
+    const LevelTask& level_task = tasks[task];
+    Tree::SetShard(&task_shards[worker]);
+    if (level_task.large == -1) {
+      Author* author = all_authors->getMutableAuthor(level_task.author);
+      RandomStream stream = Utils::MakeStream(
+          StreamId(iteration, PHASE_LEVELS, author->getId()));
+      Utils::SetStream(&stream);
+      AuthorUtils::SampleLevels(all_words,
+                                author,
+                                permute,
+                                true,
+                                corpus->getGemMean(),
+                                corpus->getGemScale());
+    } else {
+      RandomStream stream = Utils::MakeStream(
+          StreamId(iteration, PHASE_LEVEL_CHUNKS, task));
+      Utils::SetStream(&stream);
+      AuthorUtils::SampleLevelsOfWords(all_words,
+                                       &chunk_authors[level_task.chunk],
+                                       true,
+                                       corpus->getGemMean(),
+                                       corpus->getGemScale(),
+                                       large_words[level_task.large],
+                                       level_task.begin,
+                                       level_task.end);
+    }
+    Tree::SetShard(NULL);
+    task_shards[worker].mergeInto(&shards[worker]);
+  });
+  Utils::SetStream(main_stream);
+  double sample_time = Now();
+
+  for (int w = 0; w < threads; w++) {
+    shards[w].apply(tree);
+  }
+  for (int t = 0; t < task_no; t++) {
+    if (tasks[t].large == -1) continue;
+    Author* author = all_authors->getMutableAuthor(tasks[t].author);
+    const Author& chunk_author = chunk_authors[tasks[t].chunk];
+    const vector<int>& base_counts = large_counts[tasks[t].large];
+    for (int level = 0; level < depth; level++) {
+      author->updateLevelCounts(
+          level, chunk_author.getLevelCounts(level) - base_counts[level]);
+    }
+  }
+
+  double end_time = Now();
+  cout << "Parallel levels: threads " << threads
+       << " sample " << sample_time - start_time << "s"
+       << " merge " << end_time - sample_time << "s" << endl;
+  scheduler->printStatistics();
+}
+
+void ParallelSampler::SampleLevelsByVocabulary(
+    Tree* tree,
+    ModelContext* context,
+    Corpus* corpus,
+    TaskScheduler* scheduler,
+    int iteration,
+    int permute) {
+  AllWords* all_words = context->getMutableAllWords();
+  AllAuthors* all_authors = context->getMutableAllAuthors();
+  int threads = scheduler->getThreads();
+  double start_time = Now();
+
+  vector<int> word_ranges;
+  PartitionVocabulary(all_words->getIdCounts(tree->getWordNo()), threads,
+                      &word_ranges);
+  vector<vector<int> > groups;
+  PartitionAuthors(all_authors, threads, &groups);
+
+  // A group keeps its shard and stream over all sub-rounds, so the
+  // result does not depend on which thread runs it.
+  vector<TopicShard> shards(threads, TopicShard(tree));
+  vector<RandomStream> streams;
+  for (int g = 0; g < threads; g++) {
+    streams.push_back(Utils::MakeStream(
+        StreamId(iteration, PHASE_VOCABULARY, g)));
+  }
+
+  // The words of the authors of each group bucketed by range: the words
+  // of the i-th author in range r are
+  // bucket_words[g][bucket_begins[g][i * threads + r] .. next begin).
+  vector<vector<int> > bucket_words(threads);
+  vector<vector<int> > bucket_begins(threads);
+
+  RandomStream* main_stream = Utils::GetStream();
+  double merge_time = 0.0;
+  for (int round = 0; round < threads; round++) {
+    scheduler->run(threads, [&](int group, int /*worker*/) {
+      Utils::SetStream(&streams[group]);
+      Tree::SetShard(&shards[group]);
+      if (round == 0) {
+        BucketWordsByRange(all_words, all_authors, groups[group],
+                           word_ranges, threads, permute,
+                           &bucket_words[group], &bucket_begins[group]);
+      }
+
+      int range = (group + round) % threads;
+      const vector<int>& words = bucket_words[group];
+      const vector<int>& begins = bucket_begins[group];
+      int authors = groups[group].size();
+      for (int i = 0; i < authors; i++) {
+        int begin = begins[i * threads + range];
+        int end = begins[i * threads + range + 1];
+        if (begin == end) continue;
+        AuthorUtils::SampleLevelsOfWords(
+            all_words,
+            all_authors->getMutableAuthor(groups[group][i]),
+            true,
+            corpus->getGemMean(),
+            corpus->getGemScale(),
+            words,
+            begin,
+            end);
+      }
+    });
+    Tree::SetShard(NULL);
+
+    double merge_start_time = Now();
+    for (int g = 0; g < threads; g++) {
+      shards[g].apply(tree);
+    }
+    merge_time += Now() - merge_start_time;
+  }
+  Utils::SetStream(main_stream);
+
+  cout << "Vocabulary levels: threads " << threads
+       << " sample " << Now() - start_time - merge_time << "s"
+       << " merge " << merge_time << "s" << endl;
+}
+
+void ParallelSampler::PartitionVocabulary(const vector<long>& id_counts,
+                                          int range_no,
+                                          vector<int>* ranges) {
+  int word_no = id_counts.size();
+  vector<pair<long, int> > sizes;
+  for (int i = 0; i < word_no; i++) {
+    sizes.push_back(make_pair(-id_counts[i], i));
+  }
+  sort(sizes.begin(), sizes.end());
+
+  ranges->assign(word_no, 0);
+  set<pair<long, int> > masses;
+  for (int r = 0; r < range_no; r++) {
+    masses.insert(make_pair(0L, r));
+  }
+  for (int i = 0; i < word_no; i++) {
+    pair<long, int> lightest = *masses.begin();
+    masses.erase(masses.begin());
+    (*ranges)[sizes[i].second] = lightest.second;
+    lightest.first -= sizes[i].first;
+    masses.insert(lightest);
+  }
+}
+
+void ParallelSampler::BucketWordsByRange(AllWords* all_words,
+                                         AllAuthors* all_authors,
+                                         const vector<int>& author_ids,
+                                         const vector<int>& word_ranges,
+                                         int range_no,
+                                         int permute,
+                                         vector<int>* words,
+                                         vector<int>* begins) {
+  int authors = author_ids.size();
+  int total = 0;
+  for (int i = 0; i < authors; i++) {
+    total += all_authors->getMutableAuthor(author_ids[i])->getWords();
+  }
+  words->resize(total);
+  begins->assign(authors * range_no + 1, 0);
+
+  // A counting sort of the words of each author by range, which keeps
+  // the order of the words of the author within a range.
+  int begin = 0;
+  for (int i = 0; i < authors; i++) {
+    Author* author = all_authors->getMutableAuthor(author_ids[i]);
+    if (permute == 1) {
+      AuthorUtils::PermuteWords(author);
+    }
+    int* author_begins = &(*begins)[i * range_no];
+    int size = author->getWords();
+    for (int j = 0; j < size; j++) {
+      author_begins[word_ranges[all_words->getId(author->getWord(j))] + 1]++;
+    }
+    author_begins[0] = begin;
+    for (int r = 1; r <= range_no; r++) {
+      author_begins[r] += author_begins[r - 1];
+    }
+    vector<int> next(author_begins, author_begins + range_no);
+    for (int j = 0; j < size; j++) {
+      int word = author->getWord(j);
+      (*words)[next[word_ranges[all_words->getId(word)]]++] = word;
+    }
+    begin += size;
+  }
+}
+
+long ParallelSampler::StreamId(int iteration, int phase, int index) {
+  return PARALLEL_STREAM_BASE +
+      ((static_cast<long>(iteration) * PHASES + phase) << 32) + index;
+}
+
+void ParallelSampler::SortAuthorsBySize(AllAuthors* all_authors,
+                                        vector<int>* author_ids) {
+  vector<pair<int, int> > sizes;
+  for (int i = 0; i < all_authors->getAuthors(); i++) {
+    sizes.push_back(make_pair(-all_authors->getMutableAuthor(i)->getWords(),
+                              i));
+  }
+  sort(sizes.begin(), sizes.end());
+
+  author_ids->clear();
+  int size = sizes.size();
+  for (int i = 0; i < size; i++) {
+    author_ids->push_back(sizes[i].second);
+  }
+}
+
+void ParallelSampler::PartitionAuthors(AllAuthors* all_authors,
+                                       int group_no,
+                                       vector<vector<int> >* groups) {
+  vector<int> sorted_ids;
+  SortAuthorsBySize(all_authors, &sorted_ids);
+
+  // The groups ordered by their number of words, then by index, so ties
+  // go to the lowest group.
+  groups->assign(group_no, vector<int>());
+  set<pair<long, int> > sizes;
+  for (int g = 0; g < group_no; g++) {
+    sizes.insert(make_pair(0L, g));
+  }
+  int size = sorted_ids.size();
+  for (int i = 0; i < size; i++) {
+    pair<long, int> smallest = *sizes.begin();
+    sizes.erase(sizes.begin());
+    (*groups)[smallest.second].push_back(sorted_ids[i]);
+    smallest.first += all_authors->getMutableAuthor(sorted_ids[i])->getWords();
+    sizes.insert(smallest);
+  }
+}
+
+void ParallelSampler::MovePathToTree(Tree* tree, Author* author) {
+  // Topics on the path of an author who was not sampled yet still have
+  // that author, so the worker cannot have pruned them.
+  int depth = tree->getDepth();
+  for (int level = 0; level < depth; level++) {
+    int slot = author->getMutablePathTopic(level)->getSlot();
+    author->setPathTopic(level, tree->getMutableTopic(slot));
+  }
+}
+
+void ParallelSampler::PruneEmptyTopics(Tree* tree) {
+  // Each author counts on every topic of its path, so pruning the
+  // empty leaves also removes their empty ancestors.
+  int leaf_level = tree->getDepth() - 1;
+  for (int slot = tree->getSlots() - 1; slot > 0; slot--) {
+    if (tree->getLevel(slot) == leaf_level &&
+        tree->getAuthorNo(slot) == 0) {
+      TopicUtils::Prune(tree->getMutableTopic(slot));
+    }
+  }
+}
+
+}  // namespace hatm
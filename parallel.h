@@ -0,0 +1,186 @@
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "author.h"
+#include "context.h"
+#include "corpus.h"
+#include "tree.h"
+
+namespace hatm {
+
+// A work-stealing scheduler running a batch of tasks on a number of
+// worker threads.
+// The tasks are numbered 0 .. tasks - 1 and are dealt round-robin to
+// the workers in that order, so callers submit the most expensive
+// tasks first. A worker runs the tasks of its own queue from the front,
+// and when it runs out steals from the back of the queue of another
+// worker. The scheduler records the steals and the time each worker
+// spent running tasks.
+class TaskScheduler {
+ public:
+  explicit TaskScheduler(int threads);
+
+  int getThreads() const { return threads_; }
+
+  // Run the tasks and return when all of them are done. task is called
+  // with the task number and the number of the worker running it.
+  void run(int tasks, const function<void(int task, int worker)>& task);
+
+  // Statistics of the last run: the number of tasks a worker stole,
+  // the fraction of the run a worker spent running tasks, and the
+  // length of the run in seconds.
+  long getSteals(int worker) const { return steals_[worker]; }
+  double getUtilization(int worker) const;
+  double getRunTime() const { return run_time_; }
+
+  // Print the statistics of the last run.
+  void printStatistics() const;
+
+ private:
+  // The loop of a worker thread.
+  void work(int worker, const function<void(int task, int worker)>& task);
+
+  // Take the next task for the worker from its own queue or steal one,
+  // return -1 when there are no tasks left.
+  int next(int worker);
+
+  // Number of worker threads.
+  int threads_;
+
+  // Task queue of each worker, guarded by the worker's mutex.
+  vector<deque<int> > queues_;
+  vector<mutex> mutexes_;
+
+  // Statistics of the last run.
+  vector<long> steals_;
+  vector<double> busy_time_;
+  double run_time_;
+};
+
+// This class provides functionality for sampling the author paths,
+// word levels and word authors on several threads.
+// Each author or document sampled in a phase of an iteration draws from
+// its own random stream, and what a task reads does not depend on the
+// tasks other workers ran before it, so a seed and a number of threads
+// reproduce a run; work stealing only changes the timing.
+class ParallelSampler {
+ public:
+  // Sample the author of the words of all documents on the threads of
+  // the scheduler. The documents are sampled in parallel into
+  // per-document lists of moves, without changing any author; the moves
+  // are then applied to the authors in bulk, in parallel over authors,
+  // with the topic word counts kept in per-thread shards.
+  static void SampleDocumentAuthors(
+      Tree* tree,
+      ModelContext* context,
+      Corpus* corpus,
+      TaskScheduler* scheduler,
+      int iteration);
+
+  // Sample the path and the word levels of all authors on the threads
+  // of the scheduler, in the style of approximate distributed LDA.
+  // Each author is one task, submitted largest first, which samples
+  // against the copy of the tree of its worker and records its changes
+  // into its own TreeDelta; the copy is then reverted to the tree, so
+  // every author sees the tree as it was at the start of the sweep plus
+  // its own changes. At the end of the sweep the deltas are applied to
+  // the tree in author order, author paths are moved to the tree and
+  // empty topics are pruned.
+  static void SampleAuthorsAdLda(
+      Tree* tree,
+      ModelContext* context,
+      Corpus* corpus,
+      TaskScheduler* scheduler,
+      int iteration,
+      int sampling_level,
+      int permute);
+
+  // Sample the word levels of all authors on the threads of the
+  // scheduler, for the current author paths. Each author is one task,
+  // and an author with more than LEVEL_CHUNK_WORDS words is split into
+  // tasks of that many words, each with its own copy of the level
+  // counts of the author. A task keeps its word count updates in a
+  // TopicShard of its own and reads the counts of the tree as they were
+  // at the start of the phase plus its own updates. The updates are
+  // summed into a shard per worker, and those are applied to the tree
+  // at the end of the phase.
+  static void SampleLevelsSharded(
+      Tree* tree,
+      ModelContext* context,
+      Corpus* corpus,
+      TaskScheduler* scheduler,
+      int iteration,
+      int permute);
+
+  // Sample the word levels of all authors on the threads of the
+  // scheduler, for the current author paths, partitioning the model
+  // instead of the data. The vocabulary is split into one range of word
+  // ids per thread holding about the same number of words of the corpus
+  // (see PartitionVocabulary), and the authors into as many groups. In
+  // each of the threads sub-rounds, group g samples the words in range
+  // (g + round) % threads, so a word of a topic is sampled by one
+  // group at a time. The words of each author are bucketed by range
+  // once per sweep, so a sub-round only visits the words of its range.
+  // The word count updates of a group are kept in its TopicShard and
+  // applied to the tree at the end of each sub-round; within a
+  // sub-round the topic word totals only include the updates of the
+  // group itself.
+  static void SampleLevelsByVocabulary(
+      Tree* tree,
+      ModelContext* context,
+      Corpus* corpus,
+      TaskScheduler* scheduler,
+      int iteration,
+      int permute);
+
+  // Remove the topics of the tree without authors, after the changes
+  // of several workers were applied to it.
+  static void PruneEmptyTopics(Tree* tree);
+
+ private:
+  // The random stream id of the author, document or group with the
+  // given index sampled in a phase of an iteration.
+  static long StreamId(int iteration, int phase, int index);
+
+  // Return the ids of the authors, those with the most words first.
+  static void SortAuthorsBySize(AllAuthors* all_authors,
+                                vector<int>* author_ids);
+
+  // Split the authors into the given number of groups of about the same
+  // number of words, dealing the largest author first to the group
+  // with the fewest words. Each group lists its authors largest first.
+  static void PartitionAuthors(AllAuthors* all_authors, int group_no,
+                               vector<vector<int> >* groups);
+
+  // Split the word ids into range_no ranges of about the same number of
+  // words, dealing the most frequent word id first to the range with
+  // the fewest words. ranges is set to the range of each word id.
+  static void PartitionVocabulary(const vector<long>& id_counts,
+                                  int range_no,
+                                  vector<int>* ranges);
+
+  // Bucket the words of the authors by the range of their word id,
+  // permuting the words of each author first if permute is 1. The words
+  // of the i-th author in range r are
+  // words[begins[i * range_no + r] .. begins[i * range_no + r + 1]).
+  static void BucketWordsByRange(AllWords* all_words,
+                                 AllAuthors* all_authors,
+                                 const vector<int>& author_ids,
+                                 const vector<int>& word_ranges,
+                                 int range_no,
+                                 int permute,
+                                 vector<int>* words,
+                                 vector<int>* begins);
+
+  // Point the path of the author to the topics in the same slots of tree.
+  static void MovePathToTree(Tree* tree, Author* author);
+};
+
+}  // namespace hatm
+
+#endif  // PARALLEL_H_
@@ -0,0 +1,289 @@
+#include <assert.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+#include "gibbs.h"
+#include "parallel.h"
+#include "server.h"
+
+#define COMMAND_STOP 0
+#define COMMAND_SWEEP 1
+// First random stream id of the worker processes.
+#define PROCESS_STREAM_BASE (1 << 29)
+
+namespace hatm {
+
+// =======================================================================
+// ParameterServer
+// =======================================================================
+
+ParameterServer::ParameterServer(const GibbsState& input_state,
+                                 int processes) {
+  for (int w = 0; w < processes; w++) {
+    SocketTransport* server_end;
+    SocketTransport* worker_end;
+    if (!SocketTransport::CreatePair(&server_end, &worker_end)) {
+      cout << "Cannot create the transport to worker " << w << endl;
+      exit(1);
+    }
+
+    cout.flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+      cout << "Cannot fork worker " << w << endl;
+      exit(1);
+    }
+    if (pid == 0) {
+      // Keep only this worker's end, so a worker sees the server exit.
+      for (size_t i = 0; i < transports_.size(); i++) {
+        transports_[i]->close();
+      }
+      server_end->close();
+
+      RunWorker(worker_end, input_state.getTree().getDepth(),
+                input_state.getCorpus().getAuthorNo(), w, processes);
+      _exit(0);
+    }
+
+    delete worker_end;
+    transports_.push_back(server_end);
+    pids_.push_back(pid);
+  }
+}
+
+ParameterServer::~ParameterServer() {
+  MessageWriter writer;
+  writer.putInt(COMMAND_STOP);
+  for (size_t i = 0; i < transports_.size(); i++) {
+    transports_[i]->send(writer.getMessage());
+    delete transports_[i];
+  }
+  for (size_t i = 0; i < pids_.size(); i++) {
+    waitpid(pids_[i], NULL, 0);
+  }
+}
+
+void ParameterServer::sampleAuthors(
+    Tree* tree,
+    ModelContext* context,
+    Corpus* corpus,
+    int iteration,
+    int sampling_level,
+    int permute) {
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  AllWords* all_words = context->getMutableAllWords();
+  AllAuthors* all_authors = context->getMutableAllAuthors();
+  int processes = transports_.size();
+
+  // Partition the authors across the workers.
+  vector<vector<int> > author_ids(processes);
+  for (int i = 0; i < all_authors->getAuthors(); i++) {
+    author_ids[i % processes].push_back(i);
+  }
+
+  // Send each worker the tree, with the counts of the word ids its
+  // authors use, and the assignments of its authors.
+  long bytes = 0;
+  vector<char> word_ids(tree->getWordNo());
+  for (int w = 0; w < processes; w++) {
+    int size = author_ids[w].size();
+    int word_no = 0;
+    fill(word_ids.begin(), word_ids.end(), 0);
+    for (int i = 0; i < size; i++) {
+      Author* author = all_authors->getMutableAuthor(author_ids[w][i]);
+      int words = author->getWords();
+      for (int j = 0; j < words; j++) {
+        word_ids[all_words->getId(author->getWord(j))] = 1;
+      }
+      word_no += words;
+    }
+
+    MessageWriter writer;
+    writer.putInt(COMMAND_SWEEP);
+    writer.putInt(iteration);
+    writer.putInt(sampling_level);
+    writer.putInt(permute);
+    writer.putDouble(corpus->getGemMean());
+    writer.putDouble(corpus->getGemScale());
+    tree->serialize(&writer, &word_ids);
+    writer.putInt(word_no);
+    writer.putInt(size);
+    for (int i = 0; i < size; i++) {
+      WriteAuthor(all_words, all_authors->getMutableAuthor(author_ids[w][i]),
+                  NULL, &writer);
+    }
+    if (!transports_[w]->send(writer.getMessage())) {
+      cout << "Worker " << w << " is gone" << endl;
+      exit(1);
+    }
+    bytes += writer.getMessage().size();
+  }
+
+  // Apply the changes of the workers in a fixed order.
+  unordered_map<int, int> base_slots;
+  tree->getTopicSlots(&base_slots);
+  for (int w = 0; w < processes; w++) {
+    string reply;
+    if (!transports_[w]->receive(&reply)) {
+      cout << "Worker " << w << " is gone" << endl;
+      exit(1);
+    }
+    bytes += reply.size();
+
+    MessageReader reader(reply);
+    TreeDelta delta(0);
+    delta.deserialize(&reader);
+    unordered_map<int, int> slots(base_slots);
+    delta.apply(tree, &slots);
+
+    int size = reader.getInt();
+    for (int i = 0; i < size; i++) {
+      Author* author = all_authors->getMutableAuthor(reader.getInt());
+      ReadAuthor(tree, slots, all_words, author, NULL, &reader);
+    }
+    assert(reader.isDone());
+  }
+  ParallelSampler::PruneEmptyTopics(tree);
+
+  cout << "Process sweep: processes " << processes
+       << " " << chrono::duration<double>(
+              chrono::steady_clock::now() - start).count() << "s"
+       << " transferred " << bytes / 1048576.0 << "MB" << endl;
+}
+
+void ParameterServer::RunWorker(
+    Transport* transport,
+    int depth,
+    int author_no,
+    int worker,
+    int processes) {
+  // The words of the worker, numbered locally in each sweep.
+  Tree tree;
+  ModelContext context;
+  AllWords* all_words = context.getMutableAllWords();
+  AllAuthors* all_authors = context.getMutableAllAuthors();
+  for (int i = 0; i < author_no; i++) {
+    all_authors->addAuthor(i, depth);
+  }
+  vector<int> global_words;
+
+  string request;
+  while (transport->receive(&request)) {
+    MessageReader reader(request);
+    if (reader.getInt() != COMMAND_SWEEP) {
+      break;
+    }
+    int iteration = reader.getInt();
+    int sampling_level = reader.getInt();
+    int permute = reader.getInt();
+    double gem_mean = reader.getDouble();
+    double gem_scale = reader.getDouble();
+
+    // Pull the tree and the assignments of the authors.
+    tree.deserialize(&reader);
+    unordered_map<int, int> slots;
+    tree.getTopicSlots(&slots);
+    int word_no = reader.getInt();
+    all_words->resizeWords(word_no, author_no);
+    all_authors->getMutableAuthorWords()->resizeWords(word_no);
+    global_words.clear();
+    vector<Author*> authors(reader.getInt());
+    int size = authors.size();
+    for (int i = 0; i < size; i++) {
+      authors[i] = all_authors->getMutableAuthor(reader.getInt());
+      ReadAuthor(&tree, slots, all_words, authors[i], &global_words, &reader);
+    }
+    all_authors->getMutableAuthorWords()->compact();
+
+    RandomStream stream = Utils::MakeStream(
+        PROCESS_STREAM_BASE + iteration * processes + worker);
+    Utils::SetStream(&stream);
+    TreeDelta delta(tree.getNextId());
+    tree.setDelta(&delta);
+
+    // Sample author path and word levels.
+    for (int i = 0; i < size; i++) {
+      AuthorTreeUtils::SampleAuthorPath(
+          &tree, all_words, authors[i], true, sampling_level);
+    }
+    for (int i = 0; i < size; i++) {
+      AuthorUtils::SampleLevels(
+          all_words, authors[i], permute, true, gem_mean, gem_scale);
+    }
+    tree.setDelta(NULL);
+    Utils::SetStream(NULL);
+
+    // Push the changes and the new assignments.
+    MessageWriter writer;
+    delta.serialize(&writer);
+    writer.putInt(size);
+    for (int i = 0; i < size; i++) {
+      WriteAuthor(all_words, authors[i], &global_words, &writer);
+    }
+    if (!transport->send(writer.getMessage())) {
+      break;
+    }
+  }
+  transport->close();
+}
+
+void ParameterServer::WriteAuthor(
+    AllWords* all_words,
+    Author* author,
+    const vector<int>* global_words,
+    MessageWriter* writer) {
+  writer->putInt(author->getId());
+  int words = author->getWords();
+  writer->putInt(words);
+  for (int i = 0; i < words; i++) {
+    int word = author->getWord(i);
+    writer->putInt(global_words != NULL ? (*global_words)[word] : word);
+    writer->putInt(all_words->getId(word));
+    writer->putInt(all_words->getLevel(word));
+  }
+  int depth = author->getMutablePathTopic(0)->getMutableTree()->getDepth();
+  for (int level = 0; level < depth; level++) {
+    writer->putInt(author->getMutablePathTopic(level)->getId());
+  }
+}
+
+void ParameterServer::ReadAuthor(
+    Tree* tree,
+    const unordered_map<int, int>& slots,
+    AllWords* all_words,
+    Author* author,
+    vector<int>* global_words,
+    MessageReader* reader) {
+  int depth = tree->getDepth();
+  author->initLevelCounts(depth);
+
+  int size = reader->getInt();
+  vector<int> words(size);
+  for (int i = 0; i < size; i++) {
+    words[i] = reader->getInt();
+    if (global_words != NULL) {
+      global_words->push_back(words[i]);
+      words[i] = global_words->size() - 1;
+    }
+    int word_id = reader->getInt();
+    int level = reader->getInt();
+    all_words->setId(words[i], word_id);
+    all_words->setAuthorId(words[i], author->getId());
+    all_words->setLevel(words[i], level);
+    if (level != -1) {
+      author->updateLevelCounts(level, 1);
+    }
+  }
+  author->setWords(move(words));
+
+  for (int level = 0; level < depth; level++) {
+    author->setPathTopic(level,
+                         tree->getMutableTopic(slots.at(reader->getInt())));
+  }
+}
+
+}  // namespace hatm
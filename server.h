@@ -0,0 +1,104 @@
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#include <sys/types.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include "author.h"
+#include "context.h"
+#include "corpus.h"
+#include "message.h"
+#include "transport.h"
+#include "tree.h"
+
+namespace hatm {
+
+class GibbsState;
+
+// A parameter server sampling the author paths and word levels on
+// worker processes.
+// The process creating the server owns the authoritative tree and
+// assignments. The workers are forked from it and each owns a
+// partition of the authors. A worker keeps no copy of the corpus: in
+// every sweep it pulls the tree with the counts of only the word ids
+// its authors use, and the words and assignments of its authors, which
+// it numbers locally. It samples its authors against its copy of the
+// tree while recording the changes into a TreeDelta, and pushes the
+// delta and the new assignments back. The server applies the deltas in
+// worker order and prunes the topics left empty, as in the AD-LDA
+// sweep.
+// A worker therefore holds the topic metadata, the counts of its own
+// vocabulary in every topic and its own words; a sweep transfers the
+// metadata and those counts to each worker, plus every word twice.
+// Messages travel over a Transport, one per worker.
+class ParameterServer {
+ public:
+  // Fork processes workers from the calling process, which must have a
+  // single thread. input_state is the state read by
+  // GibbsSampler::ReadGibbsInput; the workers only take the depth of
+  // its tree and the number of authors from it.
+  ParameterServer(const GibbsState& input_state, int processes);
+
+  // Stop the workers and wait for them to exit.
+  ~ParameterServer();
+
+  ParameterServer(const ParameterServer& from) = delete;
+  ParameterServer& operator=(const ParameterServer& from) = delete;
+
+  int getProcesses() const { return transports_.size(); }
+
+  // Sample the path and the word levels of all authors on the workers.
+  // Worker w draws from its own random stream for each iteration.
+  void sampleAuthors(
+      Tree* tree,
+      ModelContext* context,
+      Corpus* corpus,
+      int iteration,
+      int sampling_level,
+      int permute);
+
+ private:
+  // The loop of a worker process, serving sweeps until it is stopped.
+  // The worker has author_no authors and a tree of the given depth.
+  static void RunWorker(
+      Transport* transport,
+      int depth,
+      int author_no,
+      int worker,
+      int processes);
+
+  // Write the id, the words with their word ids and levels, and the
+  // path topic ids of the author. The word ids go along because the
+  // words are laid out again between sweeps. If global_words is not
+  // NULL, the words are local indices and written as
+  // global_words[word].
+  static void WriteAuthor(
+      AllWords* all_words,
+      Author* author,
+      const vector<int>* global_words,
+      MessageWriter* writer);
+
+  // Read the words, word ids, word levels and path of the author,
+  // written by WriteAuthor after its id. slots maps topic ids to slots
+  // of tree. If global_words is not NULL, the words get the next local
+  // indices, and their global indices are appended to global_words.
+  static void ReadAuthor(
+      Tree* tree,
+      const unordered_map<int, int>& slots,
+      AllWords* all_words,
+      Author* author,
+      vector<int>* global_words,
+      MessageReader* reader);
+
+  // The transport to each worker.
+  vector<Transport*> transports_;
+
+  // The process id of each worker.
+  vector<pid_t> pids_;
+};
+
+}  // namespace hatm
+
+#endif  // SERVER_H_
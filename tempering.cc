@@ -0,0 +1,109 @@
+#include <assert.h>
+#include <math.h>
+
+#include <algorithm>
+#include <iostream>
+#include <thread>
+
+#include "tempering.h"
+
+// First random stream id of the tempered chains.
+#define TEMPERING_STREAM_BASE (3 << 29)
+
+namespace hatm {
+
+// =======================================================================
+// TemperingSampler
+// =======================================================================
+
+TemperingSampler::TemperingSampler(const GibbsState& input_state,
+                                   long rng_seed)
+    : temperatures_(input_state.getTemperatures()),
+      swap_lag_(input_state.getSwapLag()),
+      iteration_(0) {
+  int chains = temperatures_.size();
+  assert(chains > 0);
+
+  Utils::InitRandomNumberGen(rng_seed);
+  GibbsSampler::InitGibbsStates(input_state, chains, &gibbs_states_);
+
+  for (int i = 0; i < chains; i++) {
+    inverse_temperatures_.push_back(1.0 / temperatures_[i]);
+    streams_.push_back(Utils::MakeStream(TEMPERING_STREAM_BASE + i));
+
+    // The threads are spent on the chains, which are reported by
+    // iterate rather than printing from their threads.
+    gibbs_states_[i]->setThreads(1);
+    gibbs_states_[i]->setVerbose(false);
+  }
+  proposed_swaps_.assign(chains, 0);
+  accepted_swaps_.assign(chains, 0);
+}
+
+TemperingSampler::~TemperingSampler() {
+  for (size_t i = 0; i < gibbs_states_.size(); i++) {
+    delete gibbs_states_[i];
+  }
+}
+
+void TemperingSampler::iterate() {
+  int chains = gibbs_states_.size();
+  vector<thread> threads;
+  for (int i = 0; i < chains; i++) {
+    threads.push_back(thread([this, i]() {
+      Utils::SetStream(&streams_[i]);
+      Utils::SetInverseTemperature(inverse_temperatures_[i]);
+      GibbsSampler::IterateGibbsState(gibbs_states_[i]);
+      Utils::SetStream(NULL);
+    }));
+  }
+  for (int i = 0; i < chains; i++) {
+    threads[i].join();
+  }
+
+  iteration_++;
+  if (iteration_ % swap_lag_ == 0) {
+    proposeSwaps();
+    printAcceptanceRates();
+  }
+  for (int i = 0; i < chains; i++) {
+    const GibbsState* gibbs_state = gibbs_states_[i];
+    cout << "Tempering: iteration " << iteration_
+         << " temperature " << temperatures_[i]
+         << " score " << gibbs_state->getScore()
+         << " gem " << gibbs_state->getGemScore()
+         << " eta " << gibbs_state->getEtaScore()
+         << " gamma " << gibbs_state->getGammaScore()
+         << " topics " << gibbs_state->getTree().getLiveTopics() << endl;
+  }
+}
+
+void TemperingSampler::proposeSwaps() {
+  int chains = gibbs_states_.size();
+  for (int i = 0; i + 1 < chains; i++) {
+    double log_ratio =
+        (inverse_temperatures_[i] - inverse_temperatures_[i + 1]) *
+        (gibbs_states_[i + 1]->getScore() - gibbs_states_[i]->getScore());
+    proposed_swaps_[i]++;
+    if (log_ratio >= 0.0 || Utils::RandNo() < exp(log_ratio)) {
+      // The states change temperature, the streams stay with the
+      // temperatures.
+      swap(gibbs_states_[i], gibbs_states_[i + 1]);
+      accepted_swaps_[i]++;
+    }
+  }
+}
+
+void TemperingSampler::printAcceptanceRates() const {
+  cout << "Tempering: swap acceptance";
+  int chains = gibbs_states_.size();
+  for (int i = 0; i + 1 < chains; i++) {
+    double rate = proposed_swaps_[i] > 0 ?
+        static_cast<double>(accepted_swaps_[i]) / proposed_swaps_[i] : 0.0;
+    cout << " " << temperatures_[i] << "-" << temperatures_[i + 1]
+         << " " << rate;
+  }
+  cout << endl;
+}
+
+}  // namespace hatm
@@ -0,0 +1,76 @@
+#ifndef TEMPERING_H_
+#define TEMPERING_H_
+
+#include <vector>
+
+#include "gibbs.h"
+#include "utils.h"
+
+namespace hatm {
+
+// Parallel tempering over a ladder of temperatures.
+// One chain runs at each temperature T (the first is 1 and the others
+// ascend, see GibbsSampler::ReadGibbsInput), and
+// samples the author paths and word levels from its conditionals raised
+// to the power 1 / T, so hot chains cross between modes more easily.
+// The Metropolis-Hastings updates of Eta and the GEM parameters scale
+// their log acceptance ratios by 1 / T too, so every chain targets the
+// posterior to the power 1 / T, as the swaps require. Gamma is not
+// sampled.
+// All chains iterate concurrently, each on its own thread and random
+// stream. Every swap lag iterations the chains at neighbouring
+// temperatures propose to exchange their states, which is accepted
+// with probability min(1, exp((b_i - b_j) * (S_j - S_i))) for inverse
+// temperatures b and Gibbs scores S. The state at temperature 1 is the
+// sample of the model.
+// Each chain samples serially; the threads are spent on the chains.
+// The chains are quiet while they sweep, and iterate prints one line
+// per chain after they all finished.
+class TemperingSampler {
+ public:
+  // Initialize one chain per temperature of the input state, which was
+  // read by GibbsSampler::ReadGibbsInput.
+  TemperingSampler(const GibbsState& input_state, long rng_seed);
+  ~TemperingSampler();
+
+  TemperingSampler(const TemperingSampler& from) = delete;
+  TemperingSampler& operator=(const TemperingSampler& from) = delete;
+
+  int getChains() const { return gibbs_states_.size(); }
+
+  // The state of the chain at temperature 1.
+  GibbsState* getMutableColdState() { return gibbs_states_[0]; }
+
+  // Iterate all chains once, propose swaps every swap lag iterations,
+  // and print the scores of each chain, coldest first.
+  void iterate();
+
+  // Print the swap acceptance rate of each pair of neighbouring
+  // temperatures.
+  void printAcceptanceRates() const;
+
+ private:
+  // Propose to swap the states of each pair of neighbouring chains.
+  void proposeSwaps();
+
+  // The state at each temperature.
+  vector<GibbsState*> gibbs_states_;
+
+  // The temperatures and inverse temperatures of the chains.
+  vector<double> temperatures_;
+  vector<double> inverse_temperatures_;
+
+  // The random stream of each chain.
+  vector<RandomStream> streams_;
+
+  int swap_lag_;
+  int iteration_;
+
+  // Proposed and accepted swaps between temperatures k and k + 1.
+  vector<long> proposed_swaps_;
+  vector<long> accepted_swaps_;
+};
+
+}  // namespace hatm
+
+#endif  // TEMPERING_H_
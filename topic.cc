@@ -2,79 +2,127 @@
 #include <gsl/gsl_sf.h>
 
 #include "topic.h"
+#include "tree.h"
 
 namespace hatm {
 
 // =======================================================================
-// Topic
+// TopicWords
 // =======================================================================
-Topic::Topic(int level, Topic* parent, Tree* tree, int corpus_word_no)
-    : topic_word_no_(0),
-      corpus_word_no_(corpus_word_no),
-      author_no_(0),
-      level_(level),
-      parent_(parent),
-      tree_(tree),
-      probability_(0.0) {
-  id_ = tree->getNextId();
-  tree->incNextId(1);
-
-  // Scaling parameter sampled from prior.
-  scaling_ = tree->getScalingShape() * tree->getScalingScale();
-  // Log probabilities.
-  double eta = tree->getEta(level);
-  double word_log_pr = log(eta) - log(eta * corpus_word_no);
-
-  log_pr_word_ = vector<double>(corpus_word_no, word_log_pr);
-  word_counts_ = vector<int>(corpus_word_no, 0);
-  lgam_word_count_eta_ = vector<double>(corpus_word_no, 0.0);
-}
-
-Topic::Topic(const Topic& from, Topic* parent, Tree* tree)
-    : topic_word_no_(from.topic_word_no_),
-      corpus_word_no_(from.corpus_word_no_),
-      author_no_(from.author_no_),
-      id_(from.id_),
-      level_(from.level_),
-      scaling_(from.scaling_),
-      probability_(from.probability_) {
-  parent_ = parent;
-  for (int i = 0; i < from.getChildren(); i++) {
-    Topic* child = new Topic(*from.children_[i], this, tree);
-    children_.push_back(child);
+
+TopicWords::TopicWords()
+    : corpus_word_no_(0),
+      log_normalizer_(0.0),
+      normalizer_word_no_(-1),
+      normalizer_eta_(0.0) {
+}
+
+TopicWords::TopicWords(int corpus_word_no)
+    : corpus_word_no_(corpus_word_no),
+      word_counts_(corpus_word_no, 0),
+      count_histogram_(1, 0),
+      log_normalizer_(0.0),
+      normalizer_word_no_(-1),
+      normalizer_eta_(0.0) {
+}
+
+void TopicWords::updateWordCount(int word_id, int update) {
+  // Find the word counts for the word with word_id, and update the counts.
+  int& word_count = word_counts_.getMutable(word_id);
+  int old_count = word_count;
+  word_count += update;
+
+  // Move the word between the count-of-counts buckets.
+  int new_count = word_count;
+  if (old_count > 0) {
+    count_histogram_[old_count]--;
   }
-  tree_ = tree;
+  if (new_count > 0) {
+    if (new_count >= static_cast<int>(count_histogram_.size())) {
+      count_histogram_.resize(new_count + 1, 0);
+    }
+    count_histogram_[new_count]++;
+  }
+}
 
-  log_pr_word_ = from.log_pr_word_;
-  word_counts_ = from.word_counts_;
-  lgam_word_count_eta_ = from.lgam_word_count_eta_;
+double TopicWords::getLogNormalizer(int topic_word_no, double eta) const {
+  if (normalizer_word_no_ != topic_word_no || normalizer_eta_ != eta) {
+    log_normalizer_ = log(topic_word_no + corpus_word_no_ * eta);
+    normalizer_word_no_ = topic_word_no;
+    normalizer_eta_ = eta;
+  }
+  return log_normalizer_;
 }
 
-Topic::~Topic() {
-  int size = children_.size();
-  for (int i = 0; i < size; i++) {
-    delete children_[i];
+void TopicWords::clear() {
+  // A topic is usually retired once all its words were removed. Its
+  // counts are then all zero and a dense array needs no refill.
+  bool empty = true;
+  int max_count = getMaxCount();
+  for (int i = 1; i <= max_count && empty; i++) {
+    empty = count_histogram_[i] == 0;
   }
+  if (!empty || !word_counts_.isDense()) {
+    word_counts_.clear();
+  }
+  count_histogram_.assign(1, 0);
+  normalizer_word_no_ = -1;
 }
 
+// =======================================================================
+// Topic
+// =======================================================================
+
+Topic::Topic(Tree* tree, int slot)
+    : tree_(tree),
+      slot_(slot) {
+}
+
+int Topic::getId() const {
+  return tree_->getTopicId(slot_);
+}
+
+int Topic::getLevel() const {
+  return tree_->getLevel(slot_);
+}
+
+double Topic::getLogPrWord(int word_id) const {
+  double eta = tree_->getEta(tree_->getLevel(slot_));
+  return log(tree_->getWordCount(slot_, word_id) + eta) -
+      tree_->getLogNormalizer(slot_);
+}
+
+Topic* Topic::getMutableParent() {
+  int parent = tree_->getParent(slot_);
+  return parent == -1 ? NULL : tree_->getMutableTopic(parent);
+}
+
+void Topic::incAuthorNo(int val) {
+  tree_->incAuthorNo(slot_, val);
+}
+
+int Topic::getAuthorNo() const {
+  return tree_->getAuthorNo(slot_);
+}
+
+int Topic::getWordCount(int word_id) const {
+  return tree_->getWordCount(slot_, word_id);
+}
 
 void Topic::updateWordCount(int word_id, int update) {
-  // Find the word counts for the word with word_id, and update the counts.
-  word_counts_[word_id] += update;
-  topic_word_no_ += update;
+  tree_->updateWordCount(slot_, word_id, update);
+}
 
-  // Update log probability and log gamma.
-  double eta = tree_->getEta(level_);
+double Topic::getScaling() const {
+  return tree_->getScaling(slot_);
+}
 
-  // Update the log probability for the word.
-  double word_log_pr = log(word_counts_[word_id] + eta) -
-          log(topic_word_no_ + corpus_word_no_ * eta);
-  log_pr_word_[word_id] = word_log_pr;
+int Topic::getTopicWordNo() const {
+  return tree_->getTopicWordNo(slot_);
+}
 
-  // Update the pre-computed Gamma function (word counts + eta) for the word.
-  double lgam_word_count_eta =
-      gsl_sf_lngamma(word_counts_[word_id] + eta);
-  lgam_word_count_eta_[word_id] = lgam_word_count_eta;
+int Topic::getCorpusWordNo() const {
+  return tree_->getWordNo();
 }
 
 // =======================================================================
@@ -82,25 +130,35 @@ void Topic::updateWordCount(int word_id, int update) {
 // =======================================================================
 
 double TopicUtils::EtaScore(Topic* topic) {
-  double score = 0;
-  int word_count_size = topic->getCorpusWordNo();
-  double eta = topic->getMutableTree()->getEta(topic->getLevel());
-
-  // The current eta score.
-  score = gsl_sf_lngamma(word_count_size * eta) -
-      word_count_size * gsl_sf_lngamma(eta);
+  return EtaScoreDfs(topic->getMutableTree(), topic->getSlot());
+}
 
-  // Update the score based on the pre-computed Gamma (word count + eta)
-  for (int i = 0; i < word_count_size; i++) {
-    score += topic->getLgamWordCountEta(i);
+double TopicUtils::EtaScoreDfs(Tree* tree, int slot) {
+  double score = 0;
+  int level = tree->getLevel(slot);
+  LogGammaTable* lgam_eta = tree->getMutableLogGammaEta(level);
+  LogGammaTable* lgam_term_eta = tree->getMutableLogGammaTermEta(level);
+  const TopicWords& words = tree->getTopicWords(slot);
+
+  // The current eta score:
+  // lngamma(word_no * eta) - lngamma(topic_word_no + word_no * eta).
+  score = -lgam_term_eta->LogRising(0, tree->getTopicWordNo(slot));
+
+  // Words with count 0 cancel against the prior, so only the distinct
+  // counts contribute lngamma(count + eta) - lngamma(eta) per word.
+  int max_count = words.getMaxCount();
+  for (int i = 1; i <= max_count; i++) {
+    int count = words.getCountHistogram(i);
+    if (count > 0) {
+      score += count * lgam_eta->LogRising(0, i);
+    }
   }
 
-  score -= gsl_sf_lngamma(topic->getTopicWordNo() + word_count_size * eta);
-
   // Recursive call for the children.
-  for (int i = 0; i < topic->getChildren(); i++) {
-    if (topic->getMutableChild(i)->getTopicWordNo() > 0) {
-      score += EtaScore(topic->getMutableChild(i));
+  for (int child = tree->getFirstChild(slot); child != -1;
+       child = tree->getNextSibling(child)) {
+    if (tree->getTopicWordNo(child) > 0) {
+      score += EtaScoreDfs(tree, child);
     }
   }
 
@@ -108,15 +166,20 @@ double TopicUtils::EtaScore(Topic* topic) {
 }
 
 double TopicUtils::GammaScore(Topic* topic) {
+  return GammaScoreDfs(topic->getMutableTree(), topic->getSlot());
+}
+
+double TopicUtils::GammaScoreDfs(Tree* tree, int slot) {
   double score = 0;
 
-  if (topic->getChildren() > 0) {
-    score -= gsl_sf_lngamma(topic->getScaling() + topic->getAuthorNo());
+  if (tree->getFirstChild(slot) != -1) {
+    double scaling = tree->getScaling(slot);
+    score -= gsl_sf_lngamma(scaling + tree->getAuthorNo(slot));
 
-    for (int i = 0; i < topic->getChildren(); i++) {
-      score += gsl_sf_lngamma(
-          topic->getScaling() + topic->getMutableChild(i)->getAuthorNo());
-      score += GammaScore(topic->getMutableChild(i));
+    for (int child = tree->getFirstChild(slot); child != -1;
+         child = tree->getNextSibling(child)) {
+      score += gsl_sf_lngamma(scaling + tree->getAuthorNo(child));
+      score += GammaScoreDfs(tree, child);
     }
   }
 
@@ -135,65 +198,38 @@ Topic* TopicUtils::AddTopic(Topic* parent_topic) {
 
 Topic* TopicUtils::AddChildTopic(Topic* parent_topic) {
   // new child
-  int parent_level = parent_topic->getLevel();
-  int parent_word_counts = parent_topic->getCorpusWordNo();
-  Topic* child = new Topic(parent_level + 1, parent_topic,
-              parent_topic->getMutableTree(), parent_word_counts);
-  parent_topic->addChild(child);
-  return child;
+  Tree* tree = parent_topic->getMutableTree();
+  int slot = tree->addTopic(parent_topic->getSlot());
+  return tree->getMutableTopic(slot);
 }
 
 void TopicUtils::Prune(Topic* topic) {
-  if (topic->getAuthorNo() == 0) {
-    Topic* parent = topic->getMutableParent();
+  Tree* tree = topic->getMutableTree();
+  int slot = topic->getSlot();
+  int parent = tree->getParent(slot);
 
+  // The root topic is never removed.
+  if (tree->getAuthorNo(slot) == 0 && parent != -1) {
     // Delete topic node.
-    Remove(topic);
-    if (parent != NULL) {
-      Prune(parent);
-    }
+    Remove(tree, slot);
+    Prune(tree->getMutableTopic(parent));
   }
 }
 
-void TopicUtils::Remove(Topic* topic) {
-  for (int i = 0; i < topic->getChildren(); i++) {
-    Remove(topic->getMutableChild(i));
-  }
-
-  // Update the parent tree.
-  Topic* parent = topic->getMutableParent();
-  for (int i = 0; i < parent->getChildren(); i++) {
-    if (parent->getMutableChild(i) == topic) {
-      parent->setChild(i, parent->getMutableChild(parent->getChildren() - 1));
-      parent->removeLastChild();
-    }
+void TopicUtils::Remove(Tree* tree, int slot) {
+  while (tree->getFirstChild(slot) != -1) {
+    Remove(tree, tree->getFirstChild(slot));
   }
 
-  delete(topic);
+  // Unlink the topic from its parent and recycle the slot.
+  tree->removeTopic(slot);
 }
 
-
-Topic* TopicUtils::SampleTopic(Topic* root, double log_sum) {
-  double sum = 0.0;
-  double rand_no = Utils::RandNo();
-  return SampleDfs(root, &sum, rand_no, log_sum);
-}
-
-Topic* TopicUtils::SampleDfs(
-    Topic* topic, double* sum, double rand_no, double log_sum) {
-  *sum += exp(topic->getProbability() - log_sum);
-  if (*sum >= rand_no) {
-    return topic;
-  } else {
-    for (int i = 0; i < topic->getChildren(); i++) {
-      Topic* child = SampleDfs(
-          topic->getMutableChild(i), sum, rand_no, log_sum);
-      if (child != NULL) {
-        return child;
-      }
-    }
-  }
-  return NULL;
+Topic* TopicUtils::SampleTopic(
+    Tree* tree,
+    const vector<int>& slots,
+    const vector<double>& log_pr) {
+  return tree->getMutableTopic(slots[Utils::SampleFromLogPr(log_pr)]);
 }
 
-}  // namespace hatm
\ No newline at end of file
+}  // namespace hatm
@@ -1,110 +1,275 @@
 #ifndef TOPIC_H_
 #define TOPIC_H_
 
+#include <algorithm>
 #include <map>
+#include <utility>
 #include <vector>
 
-#include "tree.h"
-
 using namespace std;
 
 namespace hatm {
 class Tree;
 
-// The topic in the HATM implementation.
-// Each topic contains word statistics,
-// the number of authors it is assigned to,
-// the topic id, the level in the tree, a scaling factor,
-// pointers to the parent and children topics,
-// a pointer to the tree this topic belongs to,
-// and a probability for sampling the path.
-class Topic {
-public:
-	Topic(int level, Topic* parent, Tree* tree, int corpus_word_no);
-  Topic(const Topic& from) = delete;
-  Topic& operator=(const Topic& from) = delete;
-	~Topic();
-	
-	Topic(const Topic& from, Topic* parent, Tree* tree);
+// Per-topic word statistics indexed by word id.
+// Topics deep in the tree only see a small part of the vocabulary,
+// so values are kept in an open-addressing hash table (linear probing)
+// while few words are present. Word ids are Fibonacci hashed, taking
+// the high bits of the product, so runs of nearby ids spread over the
+// table. When growing the table would take more memory than a dense
+// array over the whole vocabulary, the array switches to dense
+// storage. Words not present read as default_value.
+template <typename T>
+class WordArray {
+ public:
+  WordArray()
+      : size_(0), default_value_(), used_(0), shift_(0), dense_(false) {}
+  WordArray(int size, T default_value)
+      : size_(size),
+        default_value_(default_value),
+        used_(0),
+        shift_(HashShift(INITIAL_CAPACITY)),
+        dense_(false),
+        keys_(INITIAL_CAPACITY, -1),
+        values_(INITIAL_CAPACITY, default_value) {
+    if (DenseIsSmaller(INITIAL_CAPACITY, size)) {
+      dense_ = true;
+      keys_.clear();
+      values_ = vector<T>(size, default_value);
+    }
+  }
 
-  const Tree& getTree() const { return *tree_; }
-  Tree* getMutableTree() { return tree_; }
+  T get(int word_id) const {
+    if (dense_) return values_[word_id];
+    int mask = keys_.size() - 1;
+    for (int i = Hash(word_id, shift_); ; i = (i + 1) & mask) {
+      if (keys_[i] == word_id) return values_[i];
+      if (keys_[i] == -1) return default_value_;
+    }
+  }
+
+  // Return a reference to the value of the word, inserting the word
+  // with the default value if it is not present.
+  T& getMutable(int word_id) {
+    if (dense_) return values_[word_id];
+    int mask = keys_.size() - 1;
+    int i = Hash(word_id, shift_);
+    for (; keys_[i] != -1; i = (i + 1) & mask) {
+      if (keys_[i] == word_id) return values_[i];
+    }
+    if (2 * (used_ + 1) > static_cast<int>(keys_.size())) {
+      grow();
+      return getMutable(word_id);
+    }
+    keys_[i] = word_id;
+    values_[i] = default_value_;
+    used_++;
+    return values_[i];
+  }
 
-  int getLevel() const { return level_; }
+  void set(int word_id, T value) { getMutable(word_id) = value; }
 
-  double getLogPrWord(int word_id) const { return log_pr_word_[word_id]; }
+  // Set all words to the default value, keeping the storage.
+  void clear() {
+    if (!dense_) {
+      fill(keys_.begin(), keys_.end(), -1);
+      used_ = 0;
+    }
+    fill(values_.begin(), values_.end(), default_value_);
+  }
+
+  bool isDense() const { return dense_; }
+
+  // Append the words not holding the default value, with their values.
+  void getEntries(vector<pair<int, T> >* entries) const {
+    if (dense_) {
+      for (int i = 0; i < size_; i++) {
+        if (values_[i] != default_value_) {
+          entries->push_back(make_pair(i, values_[i]));
+        }
+      }
+      return;
+    }
+    for (size_t i = 0; i < keys_.size(); i++) {
+      if (keys_[i] != -1 && values_[i] != default_value_) {
+        entries->push_back(make_pair(keys_[i], values_[i]));
+      }
+    }
+  }
 
-  int getChildren() const { return children_.size(); }
-  Topic* getMutableChild(int i) { return children_.at(i); }
-  void addChild(Topic* child) { children_.push_back(child); }
-  void setChild(int i, Topic* child) { children_.at(i) = child; }
-  void removeLastChild() { children_.pop_back(); }
+  // Number of slots held by the array.
+  int getCapacity() const { return values_.size(); }
 
-	Topic* getMutableParent() { return parent_; }
-  void setParent(Topic* parent) { parent_ = parent; }
+ private:
+  static const int INITIAL_CAPACITY = 16;
 
-  void incAuthorNo(int val) { author_no_ += val; }
-  int getAuthorNo() const { return author_no_; }
+  // The slot of the word in a table of 2^(32 - shift) slots: the top
+  // bits of the word id times 2^32 / golden ratio.
+  static int Hash(int word_id, int shift) {
+    return static_cast<int>(
+        (static_cast<unsigned int>(word_id) * 2654435769u) >> shift);
+  }
 
-  int getWordCount(int word_id) const { return word_counts_[word_id]; }
+  // The shift of Hash for a table of capacity slots, a power of 2.
+  static int HashShift(int capacity) {
+    int shift = 32;
+    for (; capacity > 1; capacity >>= 1) shift--;
+    return shift;
+  }
 
-  // Update the count of a word in a given topic.
-  void updateWordCount(int word_id, int update);
+  // Whether a hash table with capacity slots takes at least as much
+  // memory as a dense array over a vocabulary of the given size.
+  static bool DenseIsSmaller(int capacity, int size) {
+    return static_cast<size_t>(capacity) * (sizeof(int) + sizeof(T)) >=
+        static_cast<size_t>(size) * sizeof(T);
+  }
+
+  // Double the hash table, dropping the words holding the default value,
+  // or switch to dense storage once it is the smaller representation.
+  void grow() {
+    vector<int> keys;
+    vector<T> values;
+    keys.swap(keys_);
+    values.swap(values_);
+    int capacity = keys.size() * 2;
+    if (DenseIsSmaller(capacity, size_)) {
+      dense_ = true;
+      values_ = vector<T>(size_, default_value_);
+      for (size_t i = 0; i < keys.size(); i++) {
+        if (keys[i] != -1) values_[keys[i]] = values[i];
+      }
+      return;
+    }
+    keys_ = vector<int>(capacity, -1);
+    values_ = vector<T>(capacity, default_value_);
+    shift_ = HashShift(capacity);
+    used_ = 0;
+    for (size_t i = 0; i < keys.size(); i++) {
+      if (keys[i] != -1 && values[i] != default_value_) {
+        getMutable(keys[i]) = values[i];
+      }
+    }
+  }
+
+  // Size of the vocabulary.
+  int size_;
 
-  double getProbability() const { return probability_; }
-  void setProbability(double probability) { probability_ = probability; }
+  // Value of the words which are not present.
+  T default_value_;
 
-  double getScaling() const { return scaling_; }
+  // Number of occupied hash table slots.
+  int used_;
 
-  int getTopicWordNo() const { return topic_word_no_; }
+  // Shift of Hash for the current table.
+  int shift_;
+
+  // Whether values_ is a dense array indexed by word id.
+  bool dense_;
+
+  // Hash table keys, -1 marks an empty slot. Empty once dense.
+  vector<int> keys_;
+
+  // Hash table values, or the dense array.
+  vector<T> values_;
+};
 
-  double getLgamWordCountEta(int word_id) const {
-    return lgam_word_count_eta_[word_id];
+// The word statistics of a topic: the word counts and the
+// count-of-counts histogram. The tree keeps one block per topic slot.
+class TopicWords {
+ public:
+  TopicWords();
+  explicit TopicWords(int corpus_word_no);
+
+  int getWordCount(int word_id) const { return word_counts_.get(word_id); }
+
+  // Update the count of a word.
+  void updateWordCount(int word_id, int update);
+
+  // Append the words with a non-zero count, with their counts.
+  void getWordCounts(vector<pair<int, int> >* counts) const {
+    word_counts_.getEntries(counts);
   }
 
-  int getCorpusWordNo() const { return corpus_word_no_; }
+  // Number of words whose count equals count (count > 0).
+  int getCountHistogram(int count) const { return count_histogram_[count]; }
+  int getMaxCount() const { return count_histogram_.size() - 1; }
 
-private:
-	// Total number of words assigned to this topic.
-	int topic_word_no_;
+  // The log normalizer log(topic_word_no + corpus_word_no * eta),
+  // recomputed only when the word total or eta has changed.
+  double getLogNormalizer(int topic_word_no, double eta) const;
 
-	// Total number of words in the corpus.
-	int corpus_word_no_;
+  // Reset all counts to zero in place, so the buffers can be reused
+  // by another topic.
+  void clear();
 
-	// Word counts.
-	vector<int> word_counts_;
+ private:
+  // Total number of words in the corpus.
+  int corpus_word_no_;
 
-	// Log probabilities for words.
-	vector<double> log_pr_word_;
+  // Word counts.
+  WordArray<int> word_counts_;
 
-	// Precomputed lngamma(word_count + eta), 
-	// where Eta is topic Dirichlet parameter.
-	vector<double> lgam_word_count_eta_;
+  // Count-of-counts: count_histogram_[c] is the number of words
+  // with word count c. Used to compute the Eta score for any eta
+  // as a sum over the distinct counts.
+  vector<int> count_histogram_;
 
-	// Total number of authors;
-	int author_no_;
+  // Cached log normalizer and the word total and eta it was computed for.
+  mutable double log_normalizer_;
+  mutable int normalizer_word_no_;
+  mutable double normalizer_eta_;
+};
 
-	// Id of this topic.
-	int id_;
+// The topic in the HATM implementation.
+// Each topic contains word statistics,
+// the number of authors it is assigned to,
+// the topic id, the level in the tree, a scaling factor,
+// the parent and children topics,
+// and a pointer to the tree this topic belongs to.
+// The statistics are stored by the tree in arrays indexed by the topic
+// slot; a Topic is the handle through which the rest of the sampler
+// reaches one slot. Handles live as long as the tree, and a slot freed
+// by pruning is reused for a later topic.
+class Topic {
+public:
+	Topic(Tree* tree, int slot);
+  Topic(const Topic& from) = delete;
+  Topic& operator=(const Topic& from) = delete;
 
-	// Level in the tree.
-	int level_;
+  const Tree& getTree() const { return *tree_; }
+  Tree* getMutableTree() { return tree_; }
+
+  int getSlot() const { return slot_; }
+  int getId() const;
+
+  int getLevel() const;
 
-	// Scaling factor.
-	double scaling_;
+  // Log probability of the word in this topic,
+  // log(word_count + eta) - log(topic_word_no + corpus_word_no * eta).
+  double getLogPrWord(int word_id) const;
 
-	// Parent topic.
-	Topic* parent_;
+	Topic* getMutableParent();
 
-	// Children topics.
-	vector<Topic*> children_;
+  void incAuthorNo(int val);
+  int getAuthorNo() const;
+
+  int getWordCount(int word_id) const;
+
+  // Update the count of a word in a given topic.
+  void updateWordCount(int word_id, int update);
 
+  double getScaling() const;
+
+  int getTopicWordNo() const;
+
+  int getCorpusWordNo() const;
+
+private:
 	// The tree which this topic belongs to.
 	Tree* tree_;
 
-	// Probability used to sample a path.
-	double probability_;
-
+	// Slot of this topic in the tree arrays.
+	int slot_;
 };
 
 // This class provides functionality for calculating Eta and Gamma scores,
@@ -135,21 +300,23 @@ class TopicUtils {
   // Prunes the tree at the topic node.
   static void Prune(Topic* topic);
 
-  // Sample topic draws a random number and calls SampleDfs.
-  static Topic* SampleTopic(Topic* root, double log_sum);
+  // Sample a topic given the topic slots and their unnormalized log
+  // probabilities, as emitted in depth-first order by
+  // AuthorTopicUtils::ProbabilitiesDfs.
+  static Topic* SampleTopic(
+      Tree* tree,
+      const vector<int>& slots,
+      const vector<double>& log_pr);
 
  private:
-  // Removes the topic node from the tree.
-  static void Remove(Topic* topic);
-
-  // Selects a topic node in the tree given the random number and the
-  // topic probability. It recursively repreats the process for all the
-  // topic children.
-  static Topic* SampleDfs(
-      Topic* topic,
-      double* sum,
-      double rand_no,
-      double log_sum);
+  // Eta score of the subtree at the slot.
+  static double EtaScoreDfs(Tree* tree, int slot);
+
+  // Gamma score of the subtree at the slot.
+  static double GammaScoreDfs(Tree* tree, int slot);
+
+  // Removes the topic node at the slot from the tree.
+  static void Remove(Tree* tree, int slot);
 };
 
 }  // namespace hatm
@@ -0,0 +1,77 @@
+#include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "transport.h"
+
+namespace hatm {
+
+// =======================================================================
+// SocketTransport
+// =======================================================================
+
+SocketTransport::SocketTransport(int fd)
+    : fd_(fd) {
+}
+
+SocketTransport::~SocketTransport() {
+  close();
+}
+
+bool SocketTransport::CreatePair(SocketTransport** first,
+                                 SocketTransport** second) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    return false;
+  }
+  *first = new SocketTransport(fds[0]);
+  *second = new SocketTransport(fds[1]);
+  return true;
+}
+
+bool SocketTransport::send(const string& message) {
+  uint64_t size = message.size();
+  return write(reinterpret_cast<const char*>(&size), sizeof(size)) &&
+      write(message.data(), message.size());
+}
+
+bool SocketTransport::receive(string* message) {
+  uint64_t size;
+  if (!read(reinterpret_cast<char*>(&size), sizeof(size))) {
+    return false;
+  }
+  message->resize(size);
+  return size == 0 || read(&(*message)[0], size);
+}
+
+void SocketTransport::close() {
+  if (fd_ != -1) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+bool SocketTransport::write(const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t written = ::write(fd_, data, size);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return false;
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+bool SocketTransport::read(char* data, size_t size) {
+  while (size > 0) {
+    ssize_t got = ::read(fd_, data, size);
+    if (got < 0 && errno == EINTR) continue;
+    if (got <= 0) return false;
+    data += got;
+    size -= got;
+  }
+  return true;
+}
+
+}  // namespace hatm
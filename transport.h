@@ -0,0 +1,57 @@
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+
+#include <string>
+
+using namespace std;
+
+namespace hatm {
+
+// A bidirectional channel carrying whole messages between the parameter
+// server and one worker process. Implementations decide how the bytes
+// travel; the sampler only sees messages.
+class Transport {
+ public:
+  virtual ~Transport() {}
+
+  // Send a message. Return false if the channel is closed.
+  virtual bool send(const string& message) = 0;
+
+  // Receive the next message, blocking until it arrives. Return false
+  // if the channel is closed.
+  virtual bool receive(string* message) = 0;
+
+  // Close the channel, the other end then fails to receive.
+  virtual void close() = 0;
+};
+
+// A Transport over a Unix domain stream socket, for processes on one
+// host. Each message is framed by its length.
+class SocketTransport : public Transport {
+ public:
+  // Take ownership of the connected socket fd.
+  explicit SocketTransport(int fd);
+  virtual ~SocketTransport();
+
+  SocketTransport(const SocketTransport& from) = delete;
+  SocketTransport& operator=(const SocketTransport& from) = delete;
+
+  // Create a connected pair of transports, one for each end, to be
+  // shared between processes by fork. Return false on failure.
+  static bool CreatePair(SocketTransport** first, SocketTransport** second);
+
+  virtual bool send(const string& message);
+  virtual bool receive(string* message);
+  virtual void close();
+
+ private:
+  // Write or read exactly size bytes.
+  bool write(const char* data, size_t size);
+  bool read(char* data, size_t size);
+
+  int fd_;
+};
+
+}  // namespace hatm
+
+#endif  // TRANSPORT_H_
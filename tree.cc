@@ -1,6 +1,9 @@
 
+#include <assert.h>
 #include <math.h>
 
+#include <algorithm>
+
 #include "tree.h"
 
 #define REP_NO_ETA 100
@@ -13,12 +16,17 @@ namespace hatm {
 // Tree
 // =======================================================================
 
+thread_local TopicShard* Tree::SHARD = NULL;
+
 Tree::Tree()
     : depth_(0),
+      word_no_(0),
       scaling_shape_(0.0),
       scaling_scale_(0.0),
-      root_topic_(NULL),
-      next_id_(0) {
+      next_id_(0),
+      peak_topics_(0),
+      reused_topics_(0),
+      delta_(NULL) {
 }
 
 Tree::Tree(int depth,
@@ -28,36 +36,530 @@ Tree::Tree(int depth,
            double scaling_scale)
     : depth_(depth),
       eta_(eta),
+      word_no_(word_no),
       scaling_shape_(scaling_shape),
       scaling_scale_(scaling_scale),
-      next_id_(0) {
-  root_topic_ = new Topic(0, NULL, this, word_no);
+      next_id_(0),
+      peak_topics_(0),
+      reused_topics_(0),
+      delta_(NULL) {
+  for (int i = 0; i < depth; i++) {
+    lgam_eta_.push_back(LogGammaTable(eta[i]));
+    lgam_term_eta_.push_back(LogGammaTable(word_no * eta[i]));
+  }
+  addTopic(-1);
 }
 
 Tree::Tree(const Tree& from)
     : depth_(from.depth_),
       eta_(from.eta_),
+      word_no_(from.word_no_),
+      lgam_eta_(from.lgam_eta_),
+      lgam_term_eta_(from.lgam_term_eta_),
       scaling_shape_(from.scaling_shape_),
       scaling_scale_(from.scaling_scale_),
-      next_id_(from.next_id_) {
-  // Create a new topic.
-  root_topic_ = new Topic(*from.root_topic_, NULL, this);
+      next_id_(from.next_id_),
+      id_(from.id_),
+      level_(from.level_),
+      author_no_(from.author_no_),
+      topic_word_no_(from.topic_word_no_),
+      scaling_(from.scaling_),
+      parent_(from.parent_),
+      first_child_(from.first_child_),
+      next_sibling_(from.next_sibling_),
+      prev_sibling_(from.prev_sibling_),
+      words_(from.words_),
+      free_slots_(from.free_slots_),
+      peak_topics_(from.peak_topics_),
+      reused_topics_(from.reused_topics_),
+      delta_(NULL) {
+  resetTopics();
 }
 
 Tree& Tree::operator =(const Tree& from) {
   if (this == &from) return *this;
   depth_ = from.depth_;
   eta_ = from.eta_;
+  word_no_ = from.word_no_;
+  lgam_eta_ = from.lgam_eta_;
+  lgam_term_eta_ = from.lgam_term_eta_;
   scaling_shape_ = from.scaling_shape_;
   scaling_scale_ = from.scaling_scale_;
   next_id_ = from.next_id_;
-  root_topic_ = new Topic(*from.root_topic_, NULL, this);
+  id_ = from.id_;
+  level_ = from.level_;
+  author_no_ = from.author_no_;
+  topic_word_no_ = from.topic_word_no_;
+  scaling_ = from.scaling_;
+  parent_ = from.parent_;
+  first_child_ = from.first_child_;
+  next_sibling_ = from.next_sibling_;
+  prev_sibling_ = from.prev_sibling_;
+  words_ = from.words_;
+  free_slots_ = from.free_slots_;
+  peak_topics_ = from.peak_topics_;
+  reused_topics_ = from.reused_topics_;
+  delta_ = NULL;
+  relinked_slots_.clear();
+  resetTopics();
 
   return *this;
 }
 
 Tree::~Tree() {
-  delete root_topic_;
+}
+
+void Tree::resetTopics() {
+  topics_.clear();
+  int slots = level_.size();
+  for (int i = 0; i < slots; i++) {
+    topics_.emplace_back(this, i);
+  }
+}
+
+int Tree::addTopic(int parent) {
+  int slot;
+  if (free_slots_.empty()) {
+    slot = level_.size();
+    id_.push_back(0);
+    level_.push_back(0);
+    author_no_.push_back(0);
+    topic_word_no_.push_back(0);
+    scaling_.push_back(0.0);
+    parent_.push_back(-1);
+    first_child_.push_back(-1);
+    next_sibling_.push_back(-1);
+    prev_sibling_.push_back(-1);
+    words_.push_back(TopicWords(word_no_));
+    topics_.emplace_back(this, slot);
+  } else {
+    // The word statistics of the slot were reset on removal.
+    slot = free_slots_.back();
+    free_slots_.pop_back();
+    reused_topics_++;
+  }
+  if (getLiveTopics() > peak_topics_) {
+    peak_topics_ = getLiveTopics();
+  }
+
+  id_[slot] = next_id_;
+  next_id_++;
+  level_[slot] = parent == -1 ? 0 : level_[parent] + 1;
+  author_no_[slot] = 0;
+  topic_word_no_[slot] = 0;
+
+  // Scaling parameter sampled from prior.
+  scaling_[slot] = scaling_shape_ * scaling_scale_;
+
+  if (delta_ != NULL) {
+    delta_->addTopic(id_[slot], parent == -1 ? -1 : id_[parent]);
+    relinked_slots_.push_back(slot);
+    if (parent != -1) {
+      relinked_slots_.push_back(parent);
+      if (first_child_[parent] != -1) {
+        relinked_slots_.push_back(first_child_[parent]);
+      }
+    }
+  }
+
+  // Link the topic as the first child of the parent.
+  parent_[slot] = parent;
+  first_child_[slot] = -1;
+  prev_sibling_[slot] = -1;
+  next_sibling_[slot] = -1;
+  if (parent != -1) {
+    int next = first_child_[parent];
+    next_sibling_[slot] = next;
+    if (next != -1) {
+      prev_sibling_[next] = slot;
+    }
+    first_child_[parent] = slot;
+  }
+
+  return slot;
+}
+
+void Tree::removeTopic(int slot) {
+  assert(first_child_[slot] == -1);
+
+  // Unlink from the parent and the siblings.
+  int parent = parent_[slot];
+  int prev = prev_sibling_[slot];
+  int next = next_sibling_[slot];
+  if (delta_ != NULL) {
+    relinked_slots_.push_back(slot);
+    relinked_slots_.push_back(prev != -1 ? prev : parent);
+    if (next != -1) {
+      relinked_slots_.push_back(next);
+    }
+  }
+  if (prev != -1) {
+    next_sibling_[prev] = next;
+  } else if (parent != -1) {
+    first_child_[parent] = next;
+  }
+  if (next != -1) {
+    prev_sibling_[next] = prev;
+  }
+
+  level_[slot] = -1;
+  parent_[slot] = -1;
+  words_[slot].clear();
+  free_slots_.push_back(slot);
+}
+
+void Tree::setEta(int i, double value) {
+  eta_[i] = value;
+  lgam_eta_[i].reset(value);
+  lgam_term_eta_[i].reset(word_no_ * value);
+}
+
+void Tree::setDelta(TreeDelta* delta) {
+  delta_ = delta;
+  if (delta_ != NULL) {
+    relinked_slots_.clear();
+  }
+}
+
+void Tree::revert(const Tree& from, const TreeDelta& delta,
+                  const unordered_map<int, int>& slots) {
+  delta_ = NULL;
+  delta.undo(this, slots);
+
+  // A slot whose topic was removed, or reused by a new topic, also gets
+  // the word statistics of from back.
+  int from_slots = from.level_.size();
+  sort(relinked_slots_.begin(), relinked_slots_.end());
+  relinked_slots_.erase(
+      unique(relinked_slots_.begin(), relinked_slots_.end()),
+      relinked_slots_.end());
+  int size = relinked_slots_.size();
+  for (int i = 0; i < size; i++) {
+    int slot = relinked_slots_[i];
+    if (slot < 0 || slot >= from_slots) continue;
+    if (id_[slot] != from.id_[slot] || level_[slot] != from.level_[slot]) {
+      words_[slot] = from.words_[slot];
+    }
+    id_[slot] = from.id_[slot];
+    level_[slot] = from.level_[slot];
+    author_no_[slot] = from.author_no_[slot];
+    topic_word_no_[slot] = from.topic_word_no_[slot];
+    scaling_[slot] = from.scaling_[slot];
+    parent_[slot] = from.parent_[slot];
+    first_child_[slot] = from.first_child_[slot];
+    next_sibling_[slot] = from.next_sibling_[slot];
+    prev_sibling_[slot] = from.prev_sibling_[slot];
+  }
+  relinked_slots_.clear();
+
+  // Drop the slots added past those of from.
+  while (static_cast<int>(level_.size()) > from_slots) {
+    id_.pop_back();
+    level_.pop_back();
+    author_no_.pop_back();
+    topic_word_no_.pop_back();
+    scaling_.pop_back();
+    parent_.pop_back();
+    first_child_.pop_back();
+    next_sibling_.pop_back();
+    prev_sibling_.pop_back();
+    words_.pop_back();
+    topics_.pop_back();
+  }
+  free_slots_ = from.free_slots_;
+  next_id_ = from.next_id_;
+}
+
+void Tree::getTopicSlots(unordered_map<int, int>* slots) const {
+  int size = level_.size();
+  for (int i = 0; i < size; i++) {
+    if (level_[i] != -1) {
+      (*slots)[id_[i]] = i;
+    }
+  }
+}
+
+void Tree::serialize(MessageWriter* writer,
+                     const vector<char>* word_ids) const {
+  writer->putInt(depth_);
+  writer->putDoubles(eta_);
+  writer->putInt(word_no_);
+  writer->putDouble(scaling_shape_);
+  writer->putDouble(scaling_scale_);
+  writer->putInt(next_id_);
+  writer->putInts(id_);
+  writer->putInts(level_);
+  writer->putInts(author_no_);
+  writer->putInts(topic_word_no_);
+  writer->putDoubles(scaling_);
+  writer->putInts(parent_);
+  writer->putInts(first_child_);
+  writer->putInts(next_sibling_);
+  writer->putInts(prev_sibling_);
+  writer->putInts(free_slots_);
+  writer->putInt(peak_topics_);
+  writer->putLong(reused_topics_);
+
+  // The non-zero word counts of each slot, of the marked word ids.
+  vector<pair<int, int> > counts;
+  int slots = level_.size();
+  for (int i = 0; i < slots; i++) {
+    counts.clear();
+    words_[i].getWordCounts(&counts);
+    if (word_ids != NULL) {
+      int size = 0;
+      for (size_t j = 0; j < counts.size(); j++) {
+        if ((*word_ids)[counts[j].first]) {
+          counts[size++] = counts[j];
+        }
+      }
+      counts.resize(size);
+    }
+    writer->putInt(counts.size());
+    for (size_t j = 0; j < counts.size(); j++) {
+      writer->putInt(counts[j].first);
+      writer->putInt(counts[j].second);
+    }
+  }
+}
+
+void Tree::deserialize(MessageReader* reader) {
+  depth_ = reader->getInt();
+  reader->getDoubles(&eta_);
+  word_no_ = reader->getInt();
+  scaling_shape_ = reader->getDouble();
+  scaling_scale_ = reader->getDouble();
+  next_id_ = reader->getInt();
+  reader->getInts(&id_);
+  reader->getInts(&level_);
+  reader->getInts(&author_no_);
+  reader->getInts(&topic_word_no_);
+  reader->getDoubles(&scaling_);
+  reader->getInts(&parent_);
+  reader->getInts(&first_child_);
+  reader->getInts(&next_sibling_);
+  reader->getInts(&prev_sibling_);
+  reader->getInts(&free_slots_);
+  peak_topics_ = reader->getInt();
+  reused_topics_ = reader->getLong();
+
+  int slots = level_.size();
+  words_.assign(slots, TopicWords(word_no_));
+  for (int i = 0; i < slots; i++) {
+    int size = reader->getInt();
+    for (int j = 0; j < size; j++) {
+      int word_id = reader->getInt();
+      words_[i].updateWordCount(word_id, reader->getInt());
+    }
+  }
+
+  // Keep the tables if eta did not change.
+  lgam_eta_.resize(depth_);
+  lgam_term_eta_.resize(depth_);
+  for (int i = 0; i < depth_; i++) {
+    lgam_eta_[i].reset(eta_[i]);
+    lgam_term_eta_[i].reset(word_no_ * eta_[i]);
+  }
+  delta_ = NULL;
+  relinked_slots_.clear();
+  resetTopics();
+}
+
+// =======================================================================
+// TopicShard
+// =======================================================================
+
+TopicShard::TopicShard(const Tree* tree)
+    : tree_(tree) {
+}
+
+double TopicShard::getLogNormalizer(int slot, int topic_word_no,
+                                    double eta) const {
+  if (slot >= static_cast<int>(log_normalizers_.size())) {
+    int slots = tree_->getSlots();
+    log_normalizers_.resize(slots, 0.0);
+    normalizer_word_no_.resize(slots, -1);
+    normalizer_eta_.resize(slots, 0.0);
+  }
+  if (normalizer_word_no_[slot] != topic_word_no ||
+      normalizer_eta_[slot] != eta) {
+    log_normalizers_[slot] = log(topic_word_no + tree_->getWordNo() * eta);
+    normalizer_word_no_[slot] = topic_word_no;
+    normalizer_eta_[slot] = eta;
+  }
+  return log_normalizers_[slot];
+}
+
+void TopicShard::updateWordCount(int slot, int word_id, int update) {
+  if (!isTouched(slot)) {
+    if (slot >= static_cast<int>(touched_.size())) {
+      int slots = tree_->getSlots();
+      touched_.resize(slots, 0);
+      word_deltas_.resize(slots);
+      word_no_deltas_.resize(slots, 0);
+    }
+    if (word_deltas_[slot].getCapacity() == 0) {
+      word_deltas_[slot] = WordArray<int>(tree_->getWordNo(), 0);
+    }
+    touched_[slot] = 1;
+    touched_slots_.push_back(slot);
+  }
+  word_deltas_[slot].getMutable(word_id) += update;
+  word_no_deltas_[slot] += update;
+}
+
+void TopicShard::apply(Tree* tree) {
+  assert(!tree->isSharded());
+  vector<pair<int, int> > entries;
+  int size = touched_slots_.size();
+  for (int i = 0; i < size; i++) {
+    int slot = touched_slots_[i];
+    entries.clear();
+    word_deltas_[slot].getEntries(&entries);
+    int entry_no = entries.size();
+    for (int j = 0; j < entry_no; j++) {
+      tree->updateWordCount(slot, entries[j].first, entries[j].second);
+    }
+    word_deltas_[slot].clear();
+    word_no_deltas_[slot] = 0;
+    touched_[slot] = 0;
+  }
+  touched_slots_.clear();
+}
+
+void TopicShard::mergeInto(TopicShard* shard) {
+  vector<pair<int, int> > entries;
+  int size = touched_slots_.size();
+  for (int i = 0; i < size; i++) {
+    int slot = touched_slots_[i];
+    entries.clear();
+    word_deltas_[slot].getEntries(&entries);
+    int entry_no = entries.size();
+    for (int j = 0; j < entry_no; j++) {
+      shard->updateWordCount(slot, entries[j].first, entries[j].second);
+    }
+    word_deltas_[slot] = WordArray<int>();
+    word_no_deltas_[slot] = 0;
+    touched_[slot] = 0;
+  }
+  touched_slots_.clear();
+}
+
+// =======================================================================
+// TreeDelta
+// =======================================================================
+
+TreeDelta::TreeDelta(int base_id)
+    : base_id_(base_id) {
+}
+
+void TreeDelta::apply(Tree* tree, unordered_map<int, int>* slots) const {
+  // Topics created in the copy get new slots, and new ids, in the tree.
+  // Parents are always created before their children.
+  unordered_map<int, int> new_slots;
+  int size = new_topics_.size();
+  for (int i = 0; i < size; i++) {
+    int parent_id = new_topics_[i].second;
+    int parent = parent_id < base_id_ ?
+        slots->at(parent_id) : new_slots.at(parent_id);
+    new_slots[new_topics_[i].first] = tree->addTopic(parent);
+  }
+
+  for (unordered_map<int, int>::const_iterator it = author_deltas_.begin();
+       it != author_deltas_.end(); ++it) {
+    int id = it->first;
+    int slot = id < base_id_ ? slots->at(id) : new_slots.at(id);
+    tree->incAuthorNo(slot, it->second);
+  }
+
+  for (unordered_map<long long, int>::const_iterator it =
+           word_deltas_.begin(); it != word_deltas_.end(); ++it) {
+    if (it->second == 0) continue;
+    int id = static_cast<int>(it->first >> 32);
+    int word_id = static_cast<int>(it->first & 0xffffffffLL);
+    int slot = id < base_id_ ? slots->at(id) : new_slots.at(id);
+    tree->updateWordCount(slot, word_id, it->second);
+  }
+
+  // Make the created topics reachable by their id in the copy.
+  for (unordered_map<int, int>::const_iterator it = new_slots.begin();
+       it != new_slots.end(); ++it) {
+    (*slots)[it->first] = it->second;
+  }
+}
+
+void TreeDelta::forgetNewTopics(unordered_map<int, int>* slots) const {
+  int size = new_topics_.size();
+  for (int i = 0; i < size; i++) {
+    slots->erase(new_topics_[i].first);
+  }
+}
+
+void TreeDelta::undo(Tree* copy,
+                     const unordered_map<int, int>& slots) const {
+  for (unordered_map<int, int>::const_iterator it = author_deltas_.begin();
+       it != author_deltas_.end(); ++it) {
+    int id = it->first;
+    if (id >= base_id_) continue;
+    int slot = slots.at(id);
+    if (copy->getLevel(slot) != -1 && copy->getTopicId(slot) == id) {
+      copy->incAuthorNo(slot, -it->second);
+    }
+  }
+
+  for (unordered_map<long long, int>::const_iterator it =
+           word_deltas_.begin(); it != word_deltas_.end(); ++it) {
+    int id = static_cast<int>(it->first >> 32);
+    if (it->second == 0 || id >= base_id_) continue;
+    int word_id = static_cast<int>(it->first & 0xffffffffLL);
+    int slot = slots.at(id);
+    if (copy->getLevel(slot) != -1 && copy->getTopicId(slot) == id) {
+      copy->updateWordCount(slot, word_id, -it->second);
+    }
+  }
+}
+
+void TreeDelta::serialize(MessageWriter* writer) const {
+  writer->putInt(base_id_);
+  writer->putInt(new_topics_.size());
+  for (size_t i = 0; i < new_topics_.size(); i++) {
+    writer->putInt(new_topics_[i].first);
+    writer->putInt(new_topics_[i].second);
+  }
+  writer->putInt(author_deltas_.size());
+  for (unordered_map<int, int>::const_iterator it = author_deltas_.begin();
+       it != author_deltas_.end(); ++it) {
+    writer->putInt(it->first);
+    writer->putInt(it->second);
+  }
+  writer->putInt(word_deltas_.size());
+  for (unordered_map<long long, int>::const_iterator it =
+           word_deltas_.begin(); it != word_deltas_.end(); ++it) {
+    writer->putLong(it->first);
+    writer->putInt(it->second);
+  }
+}
+
+void TreeDelta::deserialize(MessageReader* reader) {
+  base_id_ = reader->getInt();
+  new_topics_.clear();
+  int size = reader->getInt();
+  for (int i = 0; i < size; i++) {
+    int id = reader->getInt();
+    new_topics_.push_back(make_pair(id, reader->getInt()));
+  }
+  author_deltas_.clear();
+  size = reader->getInt();
+  for (int i = 0; i < size; i++) {
+    int id = reader->getInt();
+    author_deltas_[id] = reader->getInt();
+  }
+  word_deltas_.clear();
+  size = reader->getInt();
+  for (int i = 0; i < size; i++) {
+    long long key = reader->getLong();
+    word_deltas_[key] = reader->getInt();
+  }
 }
 
 // =======================================================================
@@ -84,8 +586,11 @@ void TreeUtils::UpdateEta(Tree* tree) {
         tree->setEta(level, new_eta);
         double new_eta_score = TopicUtils::EtaScore(
             tree->getMutableRootTopic());
+        // A tempered chain accepts by the score times its inverse
+        // temperature, as it samples the paths and levels.
         double rand = Utils::RandNo();
-        if (rand > exp(new_eta_score - root_eta_score)) {
+        if (rand > exp(Utils::GetInverseTemperature() *
+                       (new_eta_score - root_eta_score))) {
           tree->setEta(level, old_eta);
         } else {
           root_eta_score = new_eta_score;
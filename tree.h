@@ -1,19 +1,143 @@
 #ifndef TREE_H_
 #define TREE_H_
 
+#include <deque>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "message.h"
 #include "topic.h"
 #include "utils.h"
 
 namespace hatm {
 
 class Topic;
+class Tree;
+
+// The changes made to a copy of a tree, keyed by topic id so that they
+// can be applied to the tree the copy was taken from.
+// Topics existing when the copy was taken keep their id in both trees,
+// topics created in the copy have ids from base_id on.
+class TreeDelta {
+ public:
+  explicit TreeDelta(int base_id);
+
+  void addTopic(int id, int parent_id) {
+    new_topics_.push_back(make_pair(id, parent_id));
+  }
+  void updateWordCount(int id, int word_id, int update) {
+    word_deltas_[(static_cast<long long>(id) << 32) | word_id] += update;
+  }
+  void incAuthorNo(int id, int val) { author_deltas_[id] += val; }
+
+  // Apply the changes to the tree. slots maps the ids of the topics in
+  // the tree to their slots; the topics created by the copy are added
+  // to the tree and to slots. Empty topics are not pruned.
+  void apply(Tree* tree, unordered_map<int, int>* slots) const;
+
+  // Remove the topics created in the copy from slots, after apply.
+  void forgetNewTopics(unordered_map<int, int>* slots) const;
+
+  // Undo the count changes to the topics of the copy which existed when
+  // it was taken and were not removed since. slots maps their ids to
+  // their slots in the copy. The copy may not record while undoing.
+  void undo(Tree* copy, const unordered_map<int, int>& slots) const;
+
+  // Write the changes to a message, or replace them by those read from
+  // a message.
+  void serialize(MessageWriter* writer) const;
+  void deserialize(MessageReader* reader);
+
+ private:
+  // First id of the topics created in the copy.
+  int base_id_;
+
+  // Created topics (id, parent id), in order of creation.
+  vector<pair<int, int> > new_topics_;
+
+  // Word count changes, keyed by (topic id, word id).
+  unordered_map<long long, int> word_deltas_;
+
+  // Author count changes, keyed by topic id.
+  unordered_map<int, int> author_deltas_;
+};
+
+// The word count changes made by one thread to a tree, indexed by topic
+// slot. While a shard is set for a thread (see Tree::SetShard), the
+// word counts that thread reads from the tree are the counts of the
+// tree plus its shard, and the updates it makes go to the shard only,
+// so threads sampling levels never write to shared counts. The topics
+// of the tree may not be added or removed while shards are set.
+// A topic the shard touches gets a WordArray of word count changes,
+// which is dense once the topic sees a large part of the vocabulary,
+// and its own cached log normalizer. The arrays are kept by apply, so
+// a shard reused over several rounds allocates once.
+class TopicShard {
+ public:
+  explicit TopicShard(const Tree* tree);
+
+  const Tree* getTree() const { return tree_; }
+
+  // Changes to the count of a word, and to the word total, of a topic.
+  int getWordCount(int slot, int word_id) const {
+    return isTouched(slot) ? word_deltas_[slot].get(word_id) : 0;
+  }
+  int getTopicWordNo(int slot) const {
+    return isTouched(slot) ? word_no_deltas_[slot] : 0;
+  }
+
+  // The log normalizer log(topic_word_no + corpus_word_no * eta) of a
+  // topic, where topic_word_no includes the changes of the shard.
+  double getLogNormalizer(int slot, int topic_word_no, double eta) const;
+
+  void updateWordCount(int slot, int word_id, int update);
+
+  // Apply the changes to the tree of the shard and clear the shard.
+  // No shard may be set for the calling thread.
+  void apply(Tree* tree);
+
+  // Add the changes to another shard of the same tree and clear the
+  // shard. Unlike apply, the arrays are dropped, so a shard reused for
+  // many small tasks costs each task only the words it changed.
+  void mergeInto(TopicShard* shard);
+
+ private:
+  bool isTouched(int slot) const {
+    return slot < static_cast<int>(touched_.size()) && touched_[slot];
+  }
+
+  const Tree* tree_;
+
+  // Whether the shard has changes for the topic in each slot, and the
+  // touched slots in the order they were first changed.
+  vector<char> touched_;
+  vector<int> touched_slots_;
+
+  // Word count changes of each touched slot.
+  vector<WordArray<int> > word_deltas_;
+
+  // Word total changes of each touched slot.
+  vector<int> word_no_deltas_;
+
+  // Cached log normalizers, and the word total and eta they were
+  // computed for, of each slot.
+  mutable vector<double> log_normalizers_;
+  mutable vector<int> normalizer_word_no_;
+  mutable vector<double> normalizer_eta_;
+};
 
 // The tree representing the hierarchy of topics.
 // A tree has a certain depth, a number of scaling parameters,
 // the topic Dirichlet parameter and the next topic id.
-// It keeps a pointer to the root topic.
+// The topics are stored as a structure of arrays indexed by a topic
+// slot: the level, author count, word total, scaling, parent,
+// first child and siblings of each topic, and a block of word
+// statistics. Slots of removed topics are kept on a free list and
+// reused together with their word statistic buffers, which are reset
+// in place rather than freed. The root topic always has slot 0.
+// Changes can be recorded into a TreeDelta (see setDelta), or kept
+// in a per-thread TopicShard (see SetShard).
 //
 class Tree {
  public:
@@ -25,8 +149,7 @@ class Tree {
   Tree(const Tree& from);
   Tree& operator=(const Tree& from);
 
-  void setRootTopic(Topic* root_topic) { root_topic_ = root_topic; }
-  Topic* getMutableRootTopic() { return root_topic_; }
+  Topic* getMutableRootTopic() { return &topics_[0]; }
 
   int getNextId() const { return next_id_; }
   void incNextId(int val) { next_id_ += val; }
@@ -34,12 +157,137 @@ class Tree {
   double getEta(int i) const { return eta_[i]; }
   int getDepth() const { return depth_; }
 
-  void setEta(int i, double value) { eta_[i] = value; }
+  // Set the Eta value of a level, and reset the log gamma tables
+  // of the level to the new value.
+  void setEta(int i, double value);
+
+  int getWordNo() const { return word_no_; }
+
+  // Tables of lngamma(n + eta) for the level.
+  LogGammaTable* getMutableLogGammaEta(int level) {
+    return &lgam_eta_[level];
+  }
+
+  // Tables of lngamma(n + word_no * eta) for the level.
+  LogGammaTable* getMutableLogGammaTermEta(int level) {
+    return &lgam_term_eta_[level];
+  }
 
   double getScalingShape() const { return scaling_shape_; }
   double getScalingScale() const { return scaling_scale_; }
 
+  // Add a new topic as the first child of the topic in the parent slot,
+  // or the root topic if parent is -1. Returns the slot of the topic.
+  int addTopic(int parent);
+
+  // Unlink the topic in the slot, which has no children, from its parent
+  // and put the slot on the free list.
+  void removeTopic(int slot);
+
+  // The handle of the topic in the slot.
+  Topic* getMutableTopic(int slot) { return &topics_[slot]; }
+
+  // Number of slots, including free ones.
+  int getSlots() const { return level_.size(); }
+
+  // Topic pool statistics: the number of topics in the tree, the
+  // largest number of topics the tree ever held, and the number of
+  // topics created in a recycled slot.
+  int getLiveTopics() const { return level_.size() - free_slots_.size(); }
+  int getPeakTopics() const { return peak_topics_; }
+  long getReusedTopics() const { return reused_topics_; }
+
+  int getTopicId(int slot) const { return id_[slot]; }
+  int getLevel(int slot) const { return level_[slot]; }
+  double getScaling(int slot) const { return scaling_[slot]; }
+
+  int getAuthorNo(int slot) const { return author_no_[slot]; }
+  void incAuthorNo(int slot, int val) {
+    author_no_[slot] += val;
+    if (delta_ != NULL) delta_->incAuthorNo(id_[slot], val);
+  }
+
+  int getTopicWordNo(int slot) const {
+    if (isSharded()) {
+      return topic_word_no_[slot] + SHARD->getTopicWordNo(slot);
+    }
+    return topic_word_no_[slot];
+  }
+  const TopicWords& getTopicWords(int slot) const { return words_[slot]; }
+
+  // The log normalizer log(topic_word_no + word_no * eta) of the topic
+  // in the slot, cached by the topic, or by the shard of the calling
+  // thread while it is sharded.
+  double getLogNormalizer(int slot) const {
+    double eta = eta_[level_[slot]];
+    if (isSharded()) {
+      return SHARD->getLogNormalizer(slot, getTopicWordNo(slot), eta);
+    }
+    return words_[slot].getLogNormalizer(topic_word_no_[slot], eta);
+  }
+
+  // The count of a word in the topic in the slot.
+  int getWordCount(int slot, int word_id) const {
+    if (isSharded()) {
+      return words_[slot].getWordCount(word_id) +
+          SHARD->getWordCount(slot, word_id);
+    }
+    return words_[slot].getWordCount(word_id);
+  }
+
+  // Update the count of a word in the topic in the slot.
+  void updateWordCount(int slot, int word_id, int update) {
+    if (isSharded()) {
+      SHARD->updateWordCount(slot, word_id, update);
+      return;
+    }
+    words_[slot].updateWordCount(word_id, update);
+    topic_word_no_[slot] += update;
+    if (delta_ != NULL) delta_->updateWordCount(id_[slot], word_id, update);
+  }
+
+  // Parent, first child and next sibling slots, -1 if there is none.
+  int getParent(int slot) const { return parent_[slot]; }
+  int getFirstChild(int slot) const { return first_child_[slot]; }
+  int getNextSibling(int slot) const { return next_sibling_[slot]; }
+
+  // Record the following changes to the tree into delta, or stop
+  // recording if delta is NULL. Copies of the tree do not record.
+  void setDelta(TreeDelta* delta);
+
+  // Bring a copy of from back to from, after recording its changes
+  // into delta: the counts are undone (see TreeDelta::undo), and the
+  // topics added, removed or relinked since are copied back from from.
+  // from may not have changed since the copy was taken, and slots maps
+  // the ids of its topics to their slots. The cost is that of the
+  // changes, not of the tree.
+  void revert(const Tree& from, const TreeDelta& delta,
+              const unordered_map<int, int>& slots);
+
+  // Map the ids of the topics in the tree to their slots.
+  void getTopicSlots(unordered_map<int, int>* slots) const;
+
+  // Write the tree to a message, or replace the tree by one read from a
+  // message. The topics keep their slots and ids. If word_ids is not
+  // NULL, only the counts of the word ids marked in it are written, and
+  // the tree read back has no counts for the other words; the word
+  // totals of the topics are always complete.
+  void serialize(MessageWriter* writer, const vector<char>* word_ids) const;
+  void deserialize(MessageReader* reader);
+
+  // Set the shard of the calling thread, or NULL to write to the tree.
+  static void SetShard(TopicShard* shard) { SHARD = shard; }
+
+  // Whether the calling thread has a shard for this tree.
+  bool isSharded() const { return SHARD != NULL && SHARD->getTree() == this; }
+
  private:
+  // The shard of each thread.
+  static thread_local TopicShard* SHARD;
+
+  // Rebuild the topic handles after the arrays were copied.
+  void resetTopics();
+
   // Depth of the tree.
   int depth_;
 
@@ -48,18 +296,54 @@ class Tree {
   // underlying topics.
   vector<double> eta_;
 
+  // Number of distinct words in the corpus.
+  int word_no_;
+
+  // Log gamma tables for each level, offset by eta and word_no * eta.
+  vector<LogGammaTable> lgam_eta_;
+  vector<LogGammaTable> lgam_term_eta_;
+
   // Scaling shape parameter for the G prior.
   double scaling_shape_;
 
   // Scaling scale parameter for the G prior.
   double scaling_scale_;
 
-  // Root topic of the tree.
-  // Each node of the tree is associated with a topic.
-  Topic* root_topic_;
-
   // The next id for the following topic.
   int next_id_;
+
+  // Topic metadata, indexed by topic slot.
+  // Free slots have level -1.
+  vector<int> id_;
+  vector<int> level_;
+  vector<int> author_no_;
+  vector<int> topic_word_no_;
+  vector<double> scaling_;
+  vector<int> parent_;
+  vector<int> first_child_;
+  vector<int> next_sibling_;
+  vector<int> prev_sibling_;
+
+  // Word statistics, one block per topic slot.
+  vector<TopicWords> words_;
+
+  // Slots of removed topics, reused by addTopic.
+  vector<int> free_slots_;
+
+  // Topic pool statistics.
+  int peak_topics_;
+  long reused_topics_;
+
+  // Where changes are recorded, or NULL.
+  TreeDelta* delta_;
+
+  // Slots of the topics added, removed or relinked while recording,
+  // see revert.
+  vector<int> relinked_slots_;
+
+  // Topic handles, one per slot. A deque keeps their addresses stable
+  // while the tree grows.
+  deque<Topic> topics_;
 };
 
 // This class provides functionality for updating the Eta parameter.
@@ -67,7 +351,8 @@ class TreeUtils {
  public:
   // Updates the Eta parameter.
   // The new Eta score is based on Gaussian random variates.
-  // Repeat REP_NO_ETA number of times.
+  // Repeat REP_NO_ETA number of times. Like the GEM updates, the steps
+  // are tempered by the inverse temperature of the calling thread.
   static void UpdateEta(Tree* tree);
 };
 
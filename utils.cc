@@ -14,21 +14,178 @@
 
 
 #include <assert.h>
+#include <fcntl.h>
 #include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 #include <gsl/gsl_sf.h>
 
+#include <algorithm>
 #include <iostream>
 
 #include "utils.h"
 
+#define MAX_TABLE_SIZE (1 << 16)
+#define TABLE_RESEED 1024
+#define SMALL_RISING 16
+#define SMALL_SAMPLE_SIZE 8
+#define GOLDEN_GAMMA 0x9e3779b97f4a7c15ULL
+
 namespace hatm {
 
+// =======================================================================
+// LogGammaTable
+// =======================================================================
+
+LogGammaTable::LogGammaTable()
+    : offset_(0.0) {
+}
+
+LogGammaTable::LogGammaTable(double offset)
+    : offset_(offset) {
+}
+
+void LogGammaTable::reset(double offset) {
+  if (offset != offset_) {
+    offset_ = offset;
+    table_.clear();
+  }
+}
+
+void LogGammaTable::extend(int n) {
+  int size = table_.size();
+  if (size == 0) {
+    table_.push_back(gsl_sf_lngamma(offset_));
+    size = 1;
+  }
+  table_.resize(n + 1);
+  for (int i = size; i <= n; i++) {
+    // Use lngamma(x + 1) = lngamma(x) + log(x), and reseed from GSL
+    // from time to time to keep rounding errors from accumulating.
+    if (i % TABLE_RESEED == 0) {
+      table_[i] = gsl_sf_lngamma(i + offset_);
+    } else {
+      table_[i] = table_[i - 1] + log(i - 1 + offset_);
+    }
+  }
+}
+
+double LogGammaTable::LogGamma(int n) {
+  if (n >= MAX_TABLE_SIZE) {
+    return gsl_sf_lngamma(n + offset_);
+  }
+  if (n >= static_cast<int>(table_.size())) {
+    extend(n);
+  }
+  return table_[n];
+}
+
+double LogGammaTable::LogRising(int n, int k) {
+  if (n + k < MAX_TABLE_SIZE) {
+    return LogGamma(n + k) - LogGamma(n);
+  }
+  // Past the table, a few logs are cheaper than two lngamma calls. They
+  // are recomputed on each call.
+  if (k <= SMALL_RISING) {
+    double result = 0.0;
+    for (int i = 0; i < k; i++) {
+      result += log(n + i + offset_);
+    }
+    return result;
+  }
+  return gsl_sf_lngamma(n + k + offset_) - gsl_sf_lngamma(n + offset_);
+}
+
+// =======================================================================
+// MappedFile
+// =======================================================================
+
+MappedFile::MappedFile(const string& filename)
+    : open_(false),
+      data_(NULL),
+      size_(0) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == 0) {
+    open_ = true;
+    size_ = file_stat.st_size;
+  }
+  if (size_ > 0) {
+    void* data = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      open_ = false;
+      size_ = 0;
+    } else {
+      data_ = static_cast<const char*>(data);
+      // The file is read once from start to end.
+      madvise(data, size_, MADV_SEQUENTIAL);
+    }
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (data_ != NULL) {
+    munmap(const_cast<char*>(data_), size_);
+  }
+}
+
+// =======================================================================
+// RandomStream
+// =======================================================================
+
+// The SplitMix64 finalizer, a bijective mixing of 64 bits.
+static uint64_t Mix64(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+RandomStream::RandomStream()
+    : key_(0),
+      counter_(0) {
+}
+
+RandomStream::RandomStream(long seed, long stream_id)
+    : counter_(0) {
+  key_ = Mix64(Mix64(static_cast<uint64_t>(seed)) +
+               static_cast<uint64_t>(stream_id) * GOLDEN_GAMMA);
+}
+
+uint64_t RandomStream::Next() {
+  counter_++;
+  return Mix64(key_ + counter_ * GOLDEN_GAMMA);
+}
+
+double RandomStream::Uniform() {
+  // The top 53 bits give a double in [0, 1).
+  return (Next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+unsigned long RandomStream::UniformInt(unsigned long n) {
+  return static_cast<unsigned long>(Uniform() * n);
+}
+
+double RandomStream::Gauss(double mean, double stdev) {
+  // Box-Muller transform, 1 - Uniform() is in (0, 1].
+  double u = 1.0 - Uniform();
+  double v = Uniform();
+  return mean + stdev * sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
 // =======================================================================
 // Utils
 // =======================================================================
 
-gsl_rng* Utils::RANDNUMGEN = NULL;
+long Utils::SEED = 0;
+RandomStream Utils::MAIN_STREAM;
+thread_local RandomStream* Utils::STREAM = NULL;
+thread_local double Utils::INVERSE_TEMPERATURE = 1.0;
 
 double Utils::Sum(const vector<double>& v) {
   double sum = 0;
@@ -48,51 +205,112 @@ double Utils::LogSum(double log_a, double log_b) {
 }
 
 int Utils::SampleFromLogPr(const vector<double>& log_pr) {
-  assert(log_pr.size() > 0);
-  // Initialize the log_sum to the log probability at level 0.
-  double log_sum = log_pr[0];
-  int levels = log_pr.size();
+  return SampleFromLogPr(log_pr.data(), log_pr.size());
+}
+
+int Utils::SampleFromLogPr(const double* log_pr, int size) {
+  assert(size > 0);
+  if (size <= SMALL_SAMPLE_SIZE) {
+    double pr[SMALL_SAMPLE_SIZE];
+    return SampleFromLogPr(log_pr, size, pr);
+  }
 
-  // Update the log sum by taking into account all other levels.
-  for (int i = 1; i < levels; i++) {
-    log_sum = LogSum(log_sum, log_pr[i]);
+  // Reused between calls, so only the first large sample allocates.
+  static thread_local vector<double> buffer;
+  if (static_cast<int>(buffer.size()) < size) {
+    buffer.resize(size);
   }
+  return SampleFromLogPr(log_pr, size, buffer.data());
+}
 
-  // Obtain a random number.
-  double rand_no = RandNo();
+int Utils::SampleFromLogPr(const double* log_pr, int size, double* pr) {
+  // Shift by the maximum so the largest value exponentiates to 1.
+  double max_log_pr = log_pr[0];
+  for (int i = 1; i < size; i++) {
+    max_log_pr = log_pr[i] > max_log_pr ? log_pr[i] : max_log_pr;
+  }
+  double beta = INVERSE_TEMPERATURE;
+
+  if (size > SMALL_SAMPLE_SIZE) {
+    // Exponentiate each value once into prefix sums and binary search
+    // the random number, scaled to the unnormalized mass.
+    double sum = 0.0;
+    for (int i = 0; i < size; i++) {
+      sum += exp(beta * (log_pr[i] - max_log_pr));
+      pr[i] = sum;
+    }
+    double rand_no = RandNo() * sum;
+    int result = upper_bound(pr, pr + size, rand_no) - pr;
+    return result < size ? result : size - 1;
+  }
+
+  // Exponentiate each value once and accumulate the normalizer.
+  double sum = 0.0;
+  for (int i = 0; i < size; i++) {
+    pr[i] = exp(beta * (log_pr[i] - max_log_pr));
+    sum += pr[i];
+  }
+
+  // Obtain a random number, scaled to the unnormalized mass.
+  double rand_no = RandNo() * sum;
 
-  double log_exp = exp(log_pr[0] - log_sum);
   int result = 0;
-  while (rand_no >= log_exp) {
+  double cumulative = pr[0];
+  while (rand_no >= cumulative && result < size - 1) {
     result++;
-    log_exp += exp(log_pr[result] - log_sum);
+    cumulative += pr[result];
   }
 
   return result;
 }
 
 void Utils::InitRandomNumberGen(long rng_seed) {
-  if (RANDNUMGEN != NULL) return;
+  if (STREAM != NULL) return;
 
-  RANDNUMGEN = gsl_rng_alloc(gsl_rng_taus);
   cout << "Random seed = " << rng_seed << endl;
-  gsl_rng_set(RANDNUMGEN, rng_seed);
+  SEED = rng_seed;
+  MAIN_STREAM = MakeStream(0);
+  STREAM = &MAIN_STREAM;
+}
+
+RandomStream Utils::MakeStream(long stream_id) {
+  return RandomStream(SEED, stream_id);
+}
+
+RandomStream* Utils::SetStream(RandomStream* stream) {
+  RandomStream* previous = STREAM;
+  STREAM = stream;
+  return previous;
+}
+
+RandomStream* Utils::GetStream() {
+  assert(STREAM != NULL);
+  return STREAM;
+}
+
+void Utils::SetInverseTemperature(double inverse_temperature) {
+  INVERSE_TEMPERATURE = inverse_temperature;
 }
 
 void Utils::Shuffle(gsl_permutation* permutation, int size) {
-  assert(RANDNUMGEN != NULL);
-  gsl_ran_shuffle(RANDNUMGEN, permutation->data, size, sizeof(size_t));
+  RandomStream* stream = GetStream();
+  size_t* data = permutation->data;
+
+  // Fisher-Yates shuffle.
+  for (int i = size - 1; i > 0; i--) {
+    int j = stream->UniformInt(i + 1);
+    size_t value = data[i];
+    data[i] = data[j];
+    data[j] = value;
+  }
 }
 
 double Utils::RandGauss(double mean, double stdev) {
-  assert(RANDNUMGEN != NULL);
-  double gauss = gsl_ran_gaussian_ratio_method(RANDNUMGEN, stdev) + mean;
-  return(gauss);
+  return GetStream()->Gauss(mean, stdev);
 }
 
 double Utils::RandNo() {
-  assert(RANDNUMGEN != NULL);
-  return gsl_rng_uniform(RANDNUMGEN);
+  return GetStream()->Uniform();
 }
 
 }  // namespace hatm
@@ -16,19 +16,104 @@
 #ifndef UTILS_H_
 #define UTILS_H_
 
+#include <stdint.h>
 #include <gsl/gsl_permutation.h>
-#include <gsl/gsl_randist.h>
 
+#include <string>
 #include <vector>
 
 using namespace std;
 
 namespace hatm {
 
+// Tabulates lngamma(n + offset) for non-negative integers n.
+// The sampler evaluates the log gamma function at word counts shifted
+// by the Dirichlet parameter, so the values for one offset are cached
+// in a table which is extended lazily. Arguments beyond MAX_TABLE_SIZE
+// are not cached: LogRising sums the k logs on every call when k is
+// small, and otherwise falls back to GSL, as LogGamma does.
+// This class is not thread-safe, the table grows on lookups.
+class LogGammaTable {
+ public:
+  LogGammaTable();
+  explicit LogGammaTable(double offset);
+
+  double getOffset() const { return offset_; }
+
+  // Change the offset, dropping the table if it differs.
+  void reset(double offset);
+
+  // Return lngamma(n + offset).
+  double LogGamma(int n);
+
+  // Return lngamma(n + k + offset) - lngamma(n + offset), the log of the
+  // rising factorial (n + offset)(n + 1 + offset)...(n + k - 1 + offset).
+  double LogRising(int n, int k);
+
+ private:
+  // Extend the table to hold entries up to n.
+  void extend(int n);
+
+  double offset_;
+  vector<double> table_;
+};
+
+// A read-only memory mapping of a whole file.
+// The file can be read in place, without copying it into buffers.
+// A file which cannot be opened reads as empty.
+class MappedFile {
+ public:
+  explicit MappedFile(const string& filename);
+  ~MappedFile();
+
+  MappedFile(const MappedFile& from) = delete;
+  MappedFile& operator=(const MappedFile& from) = delete;
+
+  bool isOpen() const { return open_; }
+  const char* getData() const { return data_; }
+  size_t getSize() const { return size_; }
+
+ private:
+  bool open_;
+  const char* data_;
+  size_t size_;
+};
+
+// A counter-based random number stream.
+// The n-th number of a stream is a hash of the seed, the stream id and
+// the counter n, so each stream is reproducible from (seed, stream id)
+// regardless of how many numbers other streams drew, and streams can be
+// created for any number of workers without coordination.
+class RandomStream {
+ public:
+  RandomStream();
+  RandomStream(long seed, long stream_id);
+
+  // Return the next 64 random bits.
+  uint64_t Next();
+
+  // Return a uniform random number in [0, 1).
+  double Uniform();
+
+  // Return a uniform random integer in [0, n).
+  unsigned long UniformInt(unsigned long n);
+
+  // Return a Gaussian random variate with mean and stdev as parameters.
+  double Gauss(double mean, double stdev);
+
+ private:
+  // Key derived from the seed and the stream id.
+  uint64_t key_;
+
+  // Number of values drawn from the stream.
+  uint64_t counter_;
+};
+
 // This class provides functionality for summing values,
 // for reading data from files and also provides
 // an interface to gsl specific methods.
-// This class is not thread-safe (see private static gsl_rng* RANDNUMGEN).
+// Random numbers are drawn from the stream of the calling thread
+// (see SetStream), the main thread uses stream 0 of the seed.
 class Utils {
  public:
   // Sum up the values in a vector.
@@ -49,21 +134,60 @@ class Utils {
   // The vector should contain at least one element.
   static int SampleFromLogPr(const vector<double>& log_pr);
 
+  // Sample from size log probabilities stored in log_pr.
+  // The values are scaled by the inverse temperature of the calling
+  // thread, shifted by their maximum and exponentiated once,
+  // then the sample is found by a cumulative scan. Sizes up to
+  // SMALL_SAMPLE_SIZE (the usual tree depths) use a buffer on the stack,
+  // larger ones binary search the prefix sums.
+  static int SampleFromLogPr(const double* log_pr, int size);
+
   // Shuffle the values in a gsl_permutation.
   static void Shuffle(gsl_permutation* permutation, int size);
 
   // Initialize the random number generator.
   // rng_seed is the random number generator seed.
+  // The calling thread uses stream 0.
   static void InitRandomNumberGen(long rng_seed);
 
-  // Return a gsl Gaussian random variate with mean and stdev as parameters
+  // Return the stream with the given id for the current seed.
+  static RandomStream MakeStream(long stream_id);
+
+  // Set the stream used by the calling thread, and return the
+  // previous one. The stream must outlive its use.
+  static RandomStream* SetStream(RandomStream* stream);
+
+  // Return the stream of the calling thread.
+  static RandomStream* GetStream();
+
+  // Return a Gaussian random variate with mean and stdev as parameters
   static double RandGauss(double mean, double stdev);
 
-  // Return a random number using the gsl random number generator.
+  // Return a random number from the stream of the calling thread.
   static double RandNo();
 
+  // Set the inverse temperature of the calling thread. SampleFromLogPr
+  // then samples proportionally to pr^inverse_temperature, which
+  // flattens the distribution below 1, and the hyperparameter updates
+  // scale their log acceptance ratios by it. The default is 1.
+  static void SetInverseTemperature(double inverse_temperature);
+  static double GetInverseTemperature() { return INVERSE_TEMPERATURE; }
+
  private:
-  static gsl_rng* RANDNUMGEN;
+  // Sample given a buffer pr of size elements for the probabilities.
+  static int SampleFromLogPr(const double* log_pr, int size, double* pr);
+
+  // The random number generator seed.
+  static long SEED;
+
+  // Stream 0 of the seed, used by the thread calling InitRandomNumberGen.
+  static RandomStream MAIN_STREAM;
+
+  // The stream of each thread.
+  static thread_local RandomStream* STREAM;
+
+  // The inverse temperature of each thread.
+  static thread_local double INVERSE_TEMPERATURE;
 };
 
 }  // namespace hatm